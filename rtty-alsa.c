@@ -11,42 +11,101 @@
  */
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #ifdef ASOUNDLIB_H
 #include <alsa/asoundlib.h>
 #else
 #include <alsa-utils.h>
 #endif
 
-static int resample = 1;                                /* enable alsa-lib resampling */
-static snd_pcm_format_t format = SND_PCM_FORMAT_S16;    /* sample format */
+static int resample = 0;                                /* enable alsa-lib resampling */
 static unsigned int channels = 1;                       /* count of channels */
-static unsigned int rate = 44100;                       /* stream rate */
-static unsigned int buffer_time = 500000;               /* ring buffer length in us */
-static snd_pcm_sframes_t buffer_size;
-static unsigned int period_time = 100000;               /* period time in us */
-static snd_pcm_sframes_t period_size;
 static int period_event = 0;                            /* produce poll event after each period */
+static const unsigned int native_rates[] = {            /* in order of preference */
+        44100, 48000, 96000, 88200, 32000, 22050, 16000, 11025, 8000, 0
+};
+static const snd_pcm_format_t native_formats[] = {      /* in order of preference */
+        SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S24_3LE,
+        SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_U8, SND_PCM_FORMAT_UNKNOWN
+};
 
 
 
-#define BAUD_DELAY_45 22    /* 22ms = 45 baud, 60WPM */
-#define BAUD_DELAY_50 20    /* 20ms = 50 baud, 66WPM */
-#define BAUD_DELAY_57 18    /* 18ms = 56.9 baud, 75WPM  */
-#define BAUD_DELAY_74 13    /* 13ms = 74 baud, 100WPM */
+/* Baud rates in hundredths */
+#define BAUD_45 4545        /* 45.45 baud, 60WPM */
+#define BAUD_50 5000        /* 50 baud, 66WPM */
+#define BAUD_57 5688        /* 56.88 baud, 75WPM  */
+#define BAUD_74 7420        /* 74.2 baud, 100WPM */
+#define STOP_LEN 200        /* default stop length, hundredths of a bit */
+#define DATA_LEN 600        /* start plus 5 data bits, in hundredths */
 
 #define COLUMN_MAX 76
+#define FILL_MS 200         /* default keyboard fill-level target */
+#define MAX_POLL_FDS 16
+#define MAX_CLIENTS 16      /* daemon connections being read at once */
+#define URGENT_MARK "#URGENT" /* first line of an urgent daemon message */
+#define DAEMON_LEAD 4       /* --threads: symbols queued ahead of the renderer */
+#define MACROS 10           /* keyboard macros, ESC 0-9 */
+#define MSGCACHE_ENTRIES 64 /* pre-rendered messages held per run */
+#define MSGCACHE_MAX_TEXT 4096 /* longer text is always rendered live */
+#define MSGCACHE_PARAMS 10
+#define MSGCACHE_MAGIC "RTTYMSG1"
+#define ITA2_MAGIC "ITA2"
+#define ITA2_VERSION 1
+#define ITA2_HEADER_SIZE 16
+#define ITA2_USOS 1         /* ITA2 header flag */
+#define VFT_CHANNELS 16     /* --vft-channel modulators mixed at most */
+#define MAX_DEVICES 8       /* --output-dev given more than once */
+#define BUFFER_TIME 500000  /* default ring buffer length in us */
+#define PERIOD_TIME 100000  /* default period time in us */
+
+#define COS_Q31 2147483647.0 /* costab full scale, Q31 */
+#define TABLE_BITS 10       /* default quarter-wave table, 1024 entries */
+#define NCO_REPORT_PHASES (1 << 20) /* phases tried by --nco-report */
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
 
-#define COS_OFFSET 32767
+#define TONE_BLOCK 512      /* samples generated per tone call */
+#define TONE_LANES 8        /* widest vector generator, AVX2 */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#define TONE_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define TONE_NEON
+#include <arm_neon.h>
+#endif
 
 #define FREQ_LO_HZ 950
 #define FREQ_HI_HZ 1070
 
+/* Shift state of the line; the case a character needs, or SHIFT_ANY */
+#define SHIFT_LTRS      0
+#define SHIFT_FIGS      1
+#define SHIFT_UNKNOWN   2   /* after a space in FIGS with --usos */
+#define SHIFT_ANY       -1
+
 #define CHAR_A          0
 #define CHAR_Z          25
 #define CHAR_NULL       26
@@ -83,89 +142,449 @@ static int period_event = 0;                            /* produce poll event af
 #define CHAR_SOLIDUS    23
 #define CHAR_QUOTE      25
 
+/* baudot_entry flags */
+#define BAUDOT_PRINT    1   /* sent from text, echoed and counted */
+#define BAUDOT_EOL      2   /* ends the printed line */
+#define BAUDOT_SPACE    4   /* a receiver may unshift on it */
+
 #define BSIZE 4096
+#define READ_SIZE 65536     /* input read size when a file can't be mapped */
+#define FILE_FRAMES 65536   /* output buffer size when writing to a file */
+#define WAV_HEADER_SIZE 44
+#define QUEUE_SIZE 1024     /* render queue entries, a power of two */
+#define STATS_LAT_US 10     /* latency histogram bucket width */
+#define STATS_LAT_MAX 10000 /* latency histogram buckets, 100 ms */
 #define MINTABSIZE 2
 #define MAXTABSIZE 65536
 
-typedef struct rtty_conf
+#define BAUDOT_SYMBOLS  34  /* CHAR_A .. CHAR_CLOSED */
+#define SYMCACHE_PHASES 64  /* entry phase buckets per symbol */
+#define SYMPOOL_MAX (64 << 20) /* --realtime symbol pool, bytes at most */
+
+/*
+ * Modulation parameters a cached symbol frame was rendered with.
+ * Any change invalidates the symbol cache.
+ */
+typedef struct symcache_key
+{
+    int freq_low;
+    int freq_high;
+    int speed;
+    int baud;
+    int stop_len;
+    int format;
+} symcache_key;
+
+/*
+ * One pre-rendered Baudot character, entered at the phase of its
+ * bucket. It is sent either ctx->sym_frames long or one stop sample
+ * longer, as the bit clock requires; exit_phase is the NCO phase
+ * following the last sample of each, so the next symbol continues in
+ * phase.
+ */
+typedef struct sym_frame
+{
+    unsigned char *pcm;
+    unsigned int exit_phase[2];
+} sym_frame;
+
+/*
+ * How one ASCII character is sent: its symbols (two only for newline),
+ * the case they need and how it is echoed.
+ */
+typedef struct baudot_entry
+{
+    char sym[2];
+    unsigned char len;
+    signed char need;       /* SHIFT_LTRS, SHIFT_FIGS or SHIFT_ANY */
+    unsigned char flags;
+    char echo;
+} baudot_entry;
+
+/*
+ * Built once at startup, so encoding is a table index per character
+ * rather than a string of ctype calls and switches.
+ */
+static baudot_entry baudot_table[256];
+
+/* Echo of each symbol in LTRS and FIGS, 0 if it prints nothing */
+static char baudot_echo[2][BAUDOT_SYMBOLS];
+
+static const unsigned char baudot_codes[BAUDOT_SYMBOLS];
+
+/*
+ * A pre-rendered message, from the start of its first symbol to the
+ * end of its last, begun at phase 0 on a fresh line with the shift
+ * state unknown. shift and column are the line state it leaves. map is
+ * the cache file it was loaded from, or NULL when held in memory.
+ */
+typedef struct msgcache_entry
+{
+    unsigned long long hash;
+    char *text;
+    size_t text_len;
+    char *echo;
+    size_t echo_len;
+    unsigned char *pcm;
+    size_t pcm_bytes;
+    unsigned int exit_phase;
+    int shift;
+    int column;
+    void *map;
+    size_t map_len;
+} msgcache_entry;
+
+/* Cache file header, followed by the text, the echo and the PCM */
+typedef struct msgcache_hdr
+{
+    char magic[8];
+    unsigned long long hash;
+    int params[MSGCACHE_PARAMS];
+    unsigned int text_len;
+    unsigned int echo_len;
+    unsigned long long pcm_bytes;
+    unsigned int exit_phase;
+    int shift;
+    int column;
+} msgcache_hdr;
+
+/*
+ * Packed ITA2 output: 5-bit codes, first code in the low bits, after
+ * a header of ITA2_HEADER_SIZE bytes:
+ *    0  "ITA2"
+ *    4  version, flags
+ *    6  stop length, hundredths of a bit (16 bits)
+ *    8  baud rate, hundredths (32 bits)
+ *   12  number of codes (32 bits)
+ * all little endian.
+ */
+typedef struct ita2_file
+{
+    int fd;
+    unsigned int bits;
+    int nbits;
+    unsigned long codes;
+    int len;
+    unsigned char buf[BSIZE];
+} ita2_file;
+
+typedef struct rtty_conf rtty_conf;
+typedef struct rtty_render rtty_render;
+
+/*
+ * A daemon message. Until the client closes the connection it is being
+ * read into text; after that it waits in the transmit queue, sent up
+ * to sent.
+ */
+typedef struct rtty_msg
+{
+    struct rtty_msg *next;
+    char *text;
+    size_t size;
+    size_t alloc;
+    size_t sent;
+    int urgent;
+} rtty_msg;
+
+/*
+ * --stats: wakeup-to-write latency and ring fill level, kept in fixed
+ * histograms so that recording allocates nothing.
+ */
+typedef struct rtty_stats
+{
+    unsigned int lat[STATS_LAT_MAX + 1];
+    unsigned int fill[101];             /* percent of the ring */
+    unsigned long lat_count;
+    unsigned long fill_count;
+    long lat_max;
+    struct timespec wake;
+    int awake;
+} rtty_stats;
+
+/*
+ * Output sink. open() sets ctx->frames, the number of frames the
+ * synthesis loop collects in ctx->buf before handing them to write().
+ * A sink with a begin() hook supplies the buffer itself: begin()
+ * returns where the next frames are to be rendered and how many fit.
+ */
+typedef struct rtty_sink
+{
+    const char *name;
+    int (*open)(rtty_conf *ctx);
+    void (*write)(rtty_conf *ctx, const unsigned char *buf, int frames);
+    void (*close)(rtty_conf *ctx);
+    unsigned char *(*begin)(rtty_conf *ctx, int *frames);
+} rtty_sink;
+
+struct rtty_conf
 {
     char *output;
+    char *output_file;
     char *filename;
     int bits;
     int speed;
     int volume;
+    int volume_set;         /* --volume given; 0 is a volume too */
     int format;
     int use_audio;
     int PCM_MAX;
     unsigned char *buf;
-    int bufsize;
+    int bufsize;            /* bytes, ctx->frames * ctx->frame_size */
     snd_pcm_uframes_t frames;
+    int write_periods;      /* ALSA periods per write */
     snd_pcm_uframes_t write_total;
     snd_pcm_hw_params_t *hwparams; /* Maybe not needed here */
     snd_pcm_sw_params_t *swparams;
     snd_pcm_t *pcm;
-    signed short *costab;
-    int tabsize;
-    int bit_delay;
+    int *costab;            /* quarter cosine, Q31, see gen_costab */
+    int (*kernel)(rtty_conf *ctx, int f1, int count, int *e1,
+                  unsigned char *dst);
+    int (*store)(const int *vals, int count, unsigned char *dst);
+    void (*tone)(rtty_conf *ctx, unsigned int d1, int g1, int count,
+                 int *e1, int *out);
+    const char *tone_name;
+    int table_bits;         /* 1 << table_bits entries a quarter wave */
+    int baud;               /* hundredths of a baud */
+    int stop_len;           /* hundredths of a bit */
+    long bit_err;           /* bit clock remainder, in 1/baud frames */
     int wpm;
     int fsk_shift;
     int shift;
     int freq_high;
     int freq_low;
     int column;
-    int bufidx;
-} rtty_conf;
+    int bufidx;             /* bytes */
+    int frame_size;
+    unsigned int phase;     /* NCO phase, 2^32 a cycle, carried across tones */
+    sym_frame *symcache;
+    symcache_key symkey;
+    int sym_bytes;
+    int sym_frames;         /* short length of a symbol frame */
+    int out_fd;             /* file or stdout, -1 when playing to ALSA */
+    int wav;                /* prefix file output with a RIFF header */
+    long long out_bytes;
+    FILE *tty;              /* printer echo */
+    const rtty_sink *sink;
+    unsigned char *mem;     /* memory sink */
+    long long mem_size;
+    struct timespec start;
+    unsigned char *prime;   /* one period of mark tone for xrun recovery */
+    int primecap;           /* bytes allocated for ctx->prime */
+    int xruns;
+    int short_writes;
+    unsigned long dropped;
+    unsigned long primed;
+    snd_pcm_uframes_t mmap_offset;
+    snd_pcm_uframes_t start_frames; /* start threshold */
+    int fill_ms;            /* idle fill-level target, keyboard mode */
+    char *cache_dir;        /* message cache files, else memory only */
+    ita2_file *ita2;        /* symbols go here instead, --encode */
+    char *macro[MACROS];
+    int idle_ltrs;          /* idle with LTRS characters rather than mark */
+    int usos;               /* receivers may unshift on space */
+    int latency_ms;         /* low latency ring size, 0 for the default */
+    int threads;
+    rtty_render *render;    /* set on the input side when threaded */
+    int realtime;           /* SCHED_FIFO priority, 0 for normal */
+    int native_rate;        /* no --speed: use the device's own rate */
+    int native_format;      /* no --bits: use the device's own format */
+    int use_float;
+    int no_simd;            /* always the scalar tone generator */
+    int nco_report;
+    unsigned char *sympool; /* preallocated symbol frames, realtime */
+    int bufcap;             /* bytes allocated for ctx->buf */
+    rtty_stats *stats;
+    unsigned int buffer_time;       /* ring length asked for, us */
+    unsigned int period_time;
+    snd_pcm_sframes_t buffer_size;  /* as the device gave them, frames */
+    snd_pcm_sframes_t period_size;
+    int hold_start;         /* --link: started with the others, not alone */
+};
+
+/*
+ * Threaded operation. The input thread encodes text and queues Baudot
+ * symbols and tones on a lock-free single producer, single consumer
+ * ring; the render thread owns the output sink and a private copy of
+ * rtty_conf, and sends mark while the ring is empty.
+ */
+#define OP_SYMBOL   0       /* arg: Baudot symbol */
+#define OP_TONE     1       /* freq for arg msec */
+#define OP_STOP     2
+#define OP_CACHED   3       /* msgcache entry arg */
+
+typedef struct rtty_op
+{
+    unsigned short op;
+    unsigned short freq;
+    int arg;
+} rtty_op;
+
+struct rtty_render
+{
+    rtty_op ops[QUEUE_SIZE];
+    atomic_uint head;                   /* advanced by the input thread */
+    char pad1[64 - sizeof(atomic_uint)];
+    atomic_uint tail;                   /* advanced by the render thread */
+    char pad2[64 - sizeof(atomic_uint)];
+    pthread_t thread;
+    rtty_render *next;                  /* the next device's thread */
+    pthread_barrier_t *start;           /* --link: wait here to start */
+    int leader;                         /* starts the linked devices */
+    rtty_conf ctx;
+};
+
+/*
+ * --vft-channel: one modulator of a voice frequency telegraph group.
+ * Each has its own copy of rtty_conf, with its own tones, line state
+ * and symbol cache, and renders S32 samples through the capture sink
+ * into ctx.mem, read back as host ints as float output assumes little
+ * endian. vft_run pulls a block from every channel in turn and
+ * sums them into the one output stream.
+ */
+typedef struct vft_channel
+{
+    int freq;               /* space tone; mark is --shift above it */
+    char *input;            /* file, or - for stdin */
+    int fd;
+    int flags;              /* fd's file status flags before the run */
+    int eof;
+    char *text;             /* the last read, READ_SIZE bytes at most */
+    size_t size;
+    size_t pos;             /* next character to send */
+    int done;               /* all sent, closing sequence included */
+    long left;              /* frames of traffic not yet mixed */
+    rtty_conf ctx;
+} vft_channel;
+
+static vft_channel vft[VFT_CHANNELS];
+static int vft_count;
+
+static char *devices[MAX_DEVICES];      /* each --output-dev */
+static int device_count;
 
 void gen_costab(rtty_conf *);
+void nco_report(rtty_conf *ctx);
+void render_select(rtty_conf *ctx);
+void vft_run(rtty_conf *ctx);
+void tone_select(rtty_conf *ctx);
 void write_freq_to_alsa(rtty_conf *ctx, int f1, int msec);
+void write_tone_frames(rtty_conf *ctx, int f1, int frames);
+void pcm_flush(rtty_conf *ctx);
+int render_tone(rtty_conf *ctx, int f1, int count, int *e1, unsigned char *dst);
+int bit_frames(rtty_conf *ctx, int hundredths);
 
-void encode_bit(rtty_conf *ctx, int c);
 void encode_to_baudot(rtty_conf *ctx, char c);
-void encode_bits(rtty_conf *ctx, char *bits, int len);
-int ascii_2_baudot(char c, char *baudot, int *shift);
+void baudot_table_init(void);
+int baudot_encode(const char *text, int len, char *baudot, int *shift,
+                  int usos);
 void print_char(rtty_conf *ctx, char c);
 void initialize_tty(rtty_conf *ctx);
 void pause_print(rtty_conf *ctx, int count);
 void print_line(rtty_conf *ctx, char *line);
+void print_text(rtty_conf *ctx, const char *text, size_t size);
 void print_file(rtty_conf *ctx, char *name);
 int set_raw(int fd, struct termios *old_mode);
 void keyboard_io(rtty_conf *ctx);
+void stdin_io(rtty_conf *ctx);
+void daemon_io(rtty_conf *ctx, const char *path);
+void send_text(rtty_conf *ctx, const char *text, size_t size);
+void send_words(rtty_conf *ctx, int count, char **words);
+int ita2_header(rtty_conf *ctx, const char *path);
+int ita2_encode(rtty_conf *ctx, const char *path, int count, char **words);
+void ita2_replay(rtty_conf *ctx, const char *path);
+void msgcache_send(rtty_conf *ctx, const char *text, size_t size);
+void msgcache_play(rtty_conf *ctx, int index);
+void msgcache_macros(rtty_conf *ctx);
+const rtty_sink *sink_find(const char *name);
+void sink_close(rtty_conf *ctx);
+void render_stop(rtty_conf *ctx);
+void render_put(rtty_conf *ctx, int op, int freq, int arg);
+void render_start(rtty_conf *ctx, pthread_barrier_t *start);
+void devices_start(rtty_conf *ctx, int link);
+void pcm_alloc(rtty_conf *ctx);
+void realtime_setup(rtty_conf *ctx);
+void stats_report(rtty_conf *ctx);
 
 
 void rtty_conf_init(rtty_conf *ctx)
 {
-    ctx->output = "plughw:0,0";
-    ctx->bits = 16;
-    ctx->speed = 44100;
-    ctx->bit_delay = 22; /* 22ms = 45 baud */
-    ctx->volume = 100;
+    ctx->buffer_time = BUFFER_TIME;
+    ctx->period_time = PERIOD_TIME;
+    if (ctx->output == NULL)
+    {
+        ctx->output = "default";
+    }
+    if (ctx->bits == 0)
+    {
+        ctx->bits = 16;
+        ctx->native_format = 1;
+    }
+    if (ctx->speed == 0)
+    {
+        ctx->speed = 44100;
+        ctx->native_rate = 1;
+    }
+    if (!ctx->volume_set)
+    {
+        ctx->volume = 100;
+    }
     ctx->format = SND_PCM_FORMAT_S16_LE;
     ctx->use_audio = 0;
     ctx->PCM_MAX = 0;
     ctx->buf = NULL;
     ctx->bufsize = BSIZE;
     ctx->frames = 0;
+    if (ctx->write_periods == 0)
+    {
+        ctx->write_periods = 1;
+    }
     ctx->write_total = 0;
     ctx->costab = NULL;
-    ctx->tabsize = 1024 * 8; 
+    if (ctx->table_bits == 0)
+    {
+        ctx->table_bits = TABLE_BITS;
+    }
+    ctx->bufidx = 0;
+    ctx->frame_size = 2;
+    ctx->phase = 0;
+    ctx->symcache = NULL;
+    ctx->sym_bytes = 0;
+    ctx->out_fd = -1;
+    ctx->out_bytes = 0;
+    ctx->tty = stdout;
+    if (ctx->fill_ms == 0)
+    {
+        ctx->fill_ms = FILL_MS;
+    }
 
-    switch (ctx->wpm)
+    ctx->bit_err = 0;
+    if (ctx->stop_len == 0)
     {
-      case 60:
-        ctx->bit_delay = BAUD_DELAY_45;
-        break;
-      case 66:
-        ctx->bit_delay = BAUD_DELAY_50;
-        break;
-      case 75:
-        ctx->bit_delay = BAUD_DELAY_57;
-        break;
-      case 100:
-        ctx->bit_delay = BAUD_DELAY_74;
-        break;
-      default:
-        ctx->bit_delay = BAUD_DELAY_45;
-        break;
+        ctx->stop_len = STOP_LEN;
+    }
+
+    /* --baud wins; other than the standard speeds, wpm is baud / 0.742 */
+    if (ctx->baud == 0)
+    {
+        switch (ctx->wpm)
+        {
+          case 0:
+          case 60:
+            ctx->baud = BAUD_45;
+            break;
+          case 66:
+            ctx->baud = BAUD_50;
+            break;
+          case 75:
+            ctx->baud = BAUD_57;
+            break;
+          case 100:
+            ctx->baud = BAUD_74;
+            break;
+          default:
+            ctx->baud = (ctx->wpm * 742 + 5) / 10;
+            break;
+        }
     }
 
     if (ctx->freq_low == 0)
@@ -199,17 +618,42 @@ Usage(void) {
             "     --silent-time 50\n"
             "     --sleep-time  500\n"
             "   Audio output  options:\n"
-            "     --output-dev audio_dev | - [stdout]\n"
+            "     --output-dev audio_dev | - [stdout], up to 8 devices\n"
+            "     --link        start the devices together\n"
+            "     --output-file file[.wav]\n"
+            "     --wav\n"
+            "     --sink alsa | mmap | file | null | memory\n"
             "     --use-audio   1\n"
             "     --speed       8000\n"
-            "     --bits        8\n"
+            "     --bits        8 | 16 | 24 | 32\n"
+            "     --float\n"
+            "     --no-simd\n"
+            "     --write-periods 1\n"
+            "     --threads\n"
+            "     --realtime    priority 1-99\n"
+            "     --stats\n"
             "   Audio generation options:\n"
             "     --volume      100\n"
+            "     --table-bits  4-12, quarter-wave table size\n"
+            "     --nco-report\n"
+            "     --vft-channel freq:file, space tone and input, up to 16\n"
             "   RTTY options:\n"
             "     --input-file\n"
             "     --test-data\n"
             "     --keyboard\n"
+            "     --stdin\n"
+            "     --daemon      socket path\n"
+            "     --cache-dir   directory\n"
+            "     --macro       0-9:text\n"
+            "     --encode      file\n"
+            "     --replay      file\n"
+            "     --fill-ms     200\n"
+            "     --idle mark | ltrs\n"
+            "     --latency ms\n"
             "     --wpm 60 | 66 | 75 | 100\n"
+            "     --baud 45.45\n"
+            "     --stop 1 | 1.42 | 1.5 | 2\n"
+            "     --usos\n"
             "     --freq 500-3000\n"
             "     --shift 170 | 425 | 850\n"
             );
@@ -235,9 +679,32 @@ getvalue(int *arg, int *index, int argc,
     ++*index;
 }
 
+
+/*
+ * As getvalue, for a decimal argument stored in hundredths.
+ */
+void
+getvalue_x100(int *arg, int *index, int argc,
+     char **argv, int min, int max) 
+{
+    double d;
+
+    if (*index >= argc-1)
+        Usage();
+
+    d = atof(argv[1+*index]);
+    *arg = (int) (d * 100 + 0.5);
+
+    if (*arg < min || *arg > max) {
+        fprintf(stderr, "Value for %s should be in the range %g..%g\n", 
+                argv[*index]+2, min / 100.0, max / 100.0);
+        exit(1);
+    }
+    ++*index;
+}
+
 void test_generator(rtty_conf *ctx)
 {
-    int i = 0;
     char line[] =
         "the quick brown fox jumped over the lazy dog's back 1234567890\n"
         "ryryryryryryryryryryryryryryryryryryryryryryryryryryryryryryry\n"
@@ -245,15 +712,17 @@ void test_generator(rtty_conf *ctx)
         "ryryryryryryryryryryryryryryryryryryryryryryryryryryryryryryry\n";
 
     initialize_tty(ctx);
-    for (i=0; line[i]; i++) {
-        print_char(ctx, line[i]);
-    }
+    print_line(ctx, line);
     initialize_tty(ctx);
     write_freq_to_alsa(ctx, ctx->freq_high, 2000);
 }
 
-static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
+static int set_swparams(rtty_conf *ctx)
 {
+        snd_pcm_t *handle = ctx->pcm;
+        snd_pcm_sw_params_t *swparams = ctx->swparams;
+        snd_pcm_sframes_t buffer_size = ctx->buffer_size;
+        snd_pcm_sframes_t period_size = ctx->period_size;
         int err;
         /* get the current swparams */
         err = snd_pcm_sw_params_current(handle, swparams);
@@ -291,13 +760,18 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams)
         }
         return 0;
 }
-static int set_hwparams(snd_pcm_t *handle,
-                        snd_pcm_hw_params_t *params,
-                        snd_pcm_access_t access)
+static int set_hwparams(rtty_conf *ctx, snd_pcm_access_t access)
 {
+        snd_pcm_t *handle = ctx->pcm;
+        snd_pcm_hw_params_t *params = ctx->hwparams;
+        /* the device's own rate and format unless asked for exactly */
+        unsigned int rate = ctx->native_rate ? 0 : ctx->speed;
+        snd_pcm_format_t format = ctx->native_format ?
+                                  SND_PCM_FORMAT_UNKNOWN : ctx->format;
         unsigned int rrate;
         snd_pcm_uframes_t size;
         int err, dir;
+        int i;
         /* choose all parameters */
         err = snd_pcm_hw_params_any(handle, params);
         if (err < 0) {
@@ -316,6 +790,18 @@ static int set_hwparams(snd_pcm_t *handle,
                 printf("Access type not available for playback: %s\n", snd_strerror(err));
                 return err;
         }
+        /* pick a format the hardware takes natively, if none was asked for */
+        if (format == SND_PCM_FORMAT_UNKNOWN) {
+                for (i = 0; native_formats[i] != SND_PCM_FORMAT_UNKNOWN; i++) {
+                        if (snd_pcm_hw_params_test_format(handle, params, native_formats[i]) == 0)
+                                break;
+                }
+                format = native_formats[i];
+                if (format == SND_PCM_FORMAT_UNKNOWN) {
+                        printf("No supported sample format for playback\n");
+                        return -EINVAL;
+                }
+        }
         /* set the sample format */
         err = snd_pcm_hw_params_set_format(handle, params, format);
         if (err < 0) {
@@ -328,21 +814,33 @@ static int set_hwparams(snd_pcm_t *handle,
                 printf("Channels count (%i) not available for playbacks: %s\n", channels, snd_strerror(err));
                 return err;
         }
-        /* set the stream rate */
-        rrate = rate;
-        err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
+        /* pick a rate the hardware runs at natively, if none was asked for */
+        if (rate == 0) {
+                for (i = 0; native_rates[i]; i++) {
+                        if (snd_pcm_hw_params_test_rate(handle, params, native_rates[i], 0) == 0)
+                                break;
+                }
+                rate = native_rates[i];
+        }
+        if (rate == 0) {
+                rrate = 48000;
+                err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
+                if (err < 0) {
+                        printf("No playback rate available: %s\n", snd_strerror(err));
+                        return err;
+                }
+                rate = rrate;
+        }
+        /* set the stream rate, exactly */
+        err = snd_pcm_hw_params_set_rate(handle, params, rate, 0);
         if (err < 0) {
-                printf("Rate %iHz not available for playback: %s\n", rate, snd_strerror(err));
+                printf("Rate %iHz not available for playback without resampling: %s\n", rate, snd_strerror(err));
                 return err;
         }
-        if (rrate != rate) {
-                printf("Rate doesn't match (requested %iHz, get %iHz)\n", rate, err);
-                return -EINVAL;
-        }
         /* set the buffer time */
-        err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &buffer_time, &dir);
+        err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &ctx->buffer_time, &dir);
         if (err < 0) {
-                printf("Unable to set buffer time %i for playback: %s\n", buffer_time, snd_strerror(err));
+                printf("Unable to set buffer time %i for playback: %s\n", ctx->buffer_time, snd_strerror(err));
                 return err;
         }
         err = snd_pcm_hw_params_get_buffer_size(params, &size);
@@ -350,11 +848,11 @@ static int set_hwparams(snd_pcm_t *handle,
                 printf("Unable to get buffer size for playback: %s\n", snd_strerror(err));
                 return err;
         }
-        buffer_size = size;
+        ctx->buffer_size = size;
         /* set the period time */
-        err = snd_pcm_hw_params_set_period_time_near(handle, params, &period_time, &dir);
+        err = snd_pcm_hw_params_set_period_time_near(handle, params, &ctx->period_time, &dir);
         if (err < 0) {
-                printf("Unable to set period time %i for playback: %s\n", period_time, snd_strerror(err));
+                printf("Unable to set period time %i for playback: %s\n", ctx->period_time, snd_strerror(err));
                 return err;
         }
         err = snd_pcm_hw_params_get_period_size(params, &size, &dir);
@@ -362,630 +860,3790 @@ static int set_hwparams(snd_pcm_t *handle,
                 printf("Unable to get period size for playback: %s\n", snd_strerror(err));
                 return err;
         }
-        period_size = size;
+        ctx->period_size = size;
         /* write the parameters to device */
         err = snd_pcm_hw_params(handle, params);
         if (err < 0) {
                 printf("Unable to set hw params for playback: %s\n", snd_strerror(err));
                 return err;
         }
+        ctx->speed = rate;
+        ctx->format = format;
         return 0;
 }
 
-int main(int argc, char **argv)
+static void write_all(int fd, const unsigned char *data, int len)
 {
-    int i;
-    int test_data = 0;
-    int keyboard = 0;
-    int sts = 0;
-    snd_pcm_t *pcm = NULL;
-    snd_pcm_hw_params_t *hwparams = NULL;
-    snd_pcm_sw_params_t *swparams = NULL;
-    int channels = 1;
-    int sample_size = sizeof(short);
-    int fd = 0;
-    rtty_conf ctx = {0};
-    char *audio_device = "default";
-
-    for(i = 1; i < argc; i++) {
-        if (argv[i][0] != '-' ||
-           argv[i][1] != '-')
-            break;
+    int n;
 
-        if (!strcmp(argv[i], "--keyboard")) {
-            keyboard = 1;
-        }
-        else if (!strcmp(argv[i], "--test-data")) {
-            test_data = 1;
-        }
-        else if (!strcmp(argv[i], "--volume")) {
-            getvalue(&ctx.volume, &i, argc, argv,
-                 0, 100);
-        }
-        else if (!strcmp(argv[i], "--speed")) {
-            getvalue(&ctx.speed, &i, argc, argv,
-                 5000, 48000);
-        }
-        else if (!strcmp(argv[i], "--wpm")) {
-            getvalue(&ctx.wpm, &i, argc, argv,
-                 10, 10000);
-        }
-        else if (!strcmp(argv[i], "--shift")) {
-            getvalue(&ctx.fsk_shift, &i, argc, argv,
-                 10, 1000);
-        }
-        else if (!strcmp(argv[i], "--freq")) {
-            getvalue(&ctx.freq_low, &i, argc, argv,
-                 500, 3000);
-        }
-        else if (!strcmp(argv[i], "--bits")) {
-            getvalue(&ctx.bits, &i, argc, argv,
-                 8, 16);
-        }
-        else if (!strcmp(argv[i], "--use-audio")) {
-            getvalue(&ctx.use_audio, &i, argc, argv,
-                 0, 1);
-        }
-        else if (!strcmp(argv[i], "--input-file")) {
-            i++;
-            if (i >= argc)
-                Usage();
-            ctx.filename = argv[i];
-        }
-        else if (!strcmp(argv[i], "--output-dev")) {
-            i++;
-            if (i >= argc)
-                Usage();
-            ctx.output = argv[i];
-        }
-        else {
-            Usage();
+    while (len > 0) {
+        n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(1);
         }
+        data += n;
+        len -= n;
     }
-
-    rtty_conf_init(&ctx);
-    if (strcmp(ctx.output, "-") == 0)
-        fd = 1;     /* stdout */
-
-    fd = fd;
+}
 
 
-    switch(ctx.bits) {
-        case 8:
-            ctx.format = SND_PCM_FORMAT_U8;
-            sample_size = sizeof(char);
-            break;
-        case 16:
-            ctx.format = SND_PCM_FORMAT_S16_LE;
-            sample_size = sizeof(short);
-            break;
-        default:
-            fprintf(stderr, "Value for bits should be 8 or 16\n");
-            return(1);
+static void put_le(unsigned char *p, unsigned int val, int len)
+{
+    while (len-- > 0) {
+        *p++ = val & 0xff;
+        val >>= 8;
     }
+}
 
-    sts = snd_pcm_open(&pcm, audio_device, SND_PCM_STREAM_PLAYBACK, 0);
-    if (sts)
-    {
-        printf("alsa_init: failed %d\n", sts);
-        return 1;
-    }
-    snd_pcm_hw_params_alloca(&hwparams);
-    snd_pcm_sw_params_alloca(&swparams);
 
-    ctx.pcm = pcm;
-    ctx.hwparams = hwparams;
-    ctx.swparams = swparams;
+/*
+ * Canonical 44 byte RIFF/WAVE header for mono PCM. A
+ * data_bytes of 0xffffffff marks a stream of unknown length.
+ */
+static void wav_header(rtty_conf *ctx, unsigned char *hdr,
+                       unsigned int data_bytes)
+{
+    unsigned int riff_bytes = data_bytes;
 
-    if ((sts = set_hwparams(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-            printf("Setting of hwparams failed: %s\n", snd_strerror(sts));
-            exit(EXIT_FAILURE);
-    }
-    if ((sts = set_swparams(pcm, swparams)) < 0) {
-            printf("Setting of swparams failed: %s\n", snd_strerror(sts));
-            exit(EXIT_FAILURE);
-    }
+    if (riff_bytes <= 0xffffffff - (WAV_HEADER_SIZE - 8))
+        riff_bytes += WAV_HEADER_SIZE - 8;
 
-    ctx.frames = period_size;
-    ctx.bufsize = ctx.frames * channels * sample_size;
-    ctx.buf = (unsigned char *) malloc(ctx.bufsize);
-    ctx.PCM_MAX = snd_pcm_avail_update(ctx.pcm);
+    memcpy(hdr, "RIFF", 4);
+    put_le(hdr + 4, riff_bytes, 4);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    put_le(hdr + 16, 16, 4);                    /* fmt chunk size */
+    put_le(hdr + 20, ctx->format == SND_PCM_FORMAT_FLOAT_LE ? 3 : 1,
+           2);                                  /* PCM or IEEE float */
+    put_le(hdr + 22, 1, 2);                     /* channels */
+    put_le(hdr + 24, ctx->speed, 4);
+    put_le(hdr + 28, ctx->speed * ctx->frame_size, 4);
+    put_le(hdr + 32, ctx->frame_size, 2);
+    put_le(hdr + 34, ctx->bits, 2);
+    memcpy(hdr + 36, "data", 4);
+    put_le(hdr + 40, data_bytes, 4);
+}
 
-    gen_costab(&ctx);
-    ctx.buf = malloc(ctx.bufsize);
-    if (ctx.buf == NULL) {
-        perror("malloc buf");
-        return(1);
-    }
 
-    /* Load data into ALSA sound buffer */
-    write_freq_to_alsa(&ctx, ctx.freq_high, 500);
+/*
+ * File sink: --output-file, or stdout for "--output-dev -". Names
+ * ending in .wav get a RIFF header.
+ */
+static int file_open(rtty_conf *ctx)
+{
+    unsigned char hdr[WAV_HEADER_SIZE];
+    char *dot;
 
-    if (test_data) {
-        test_generator(&ctx);
+    if (ctx->output_file) {
+        ctx->out_fd = open(ctx->output_file, O_WRONLY | O_CREAT | O_TRUNC,
+                           0644);
+        if (ctx->out_fd < 0) {
+            perror(ctx->output_file);
+            return -1;
+        }
+        dot = strrchr(ctx->output_file, '.');
+        if (dot && !strcasecmp(dot, ".wav"))
+            ctx->wav = 1;
     }
     else {
-        pause_print(&ctx, 10);
-        initialize_tty(&ctx);
-
-        if (keyboard) 
-        {
-            keyboard_io(&ctx);
-        }
-        else if (ctx.filename) {
-            print_file(&ctx, ctx.filename);
-        }
-        else {
-            while (i < argc) {
-                print_line(&ctx, argv[i]);
-            }
-        }
+        ctx->out_fd = 1;
+        ctx->tty = stderr;  /* keep the echo out of the audio */
+    }
 
-        initialize_tty(&ctx);
-        pause_print(&ctx, 10);
+    if (ctx->wav) {
+        wav_header(ctx, hdr, 0xffffffff);
+        write_all(ctx->out_fd, hdr, sizeof(hdr));
     }
-    snd_pcm_drain(ctx.pcm);
-    snd_pcm_close(ctx.pcm);
+    ctx->frames = FILE_FRAMES;
     return 0;
 }
 
 
-void keyboard_io(rtty_conf *ctx)
+static void file_write(rtty_conf *ctx, const unsigned char *buf, int frames)
 {
-    fd_set rmask;
-    struct timeval tv;
-    char c;
-    int n;
-    struct termios old;
-    int pcm_bits = 0;
+    write_all(ctx->out_fd, buf, frames * ctx->frame_size);
+    ctx->out_bytes += frames * ctx->frame_size;
+}
 
-    set_raw(0, &old);
-    do {
-        FD_ZERO(&rmask);
-        FD_SET(0, &rmask);
-        tv.tv_sec = 0;
-        tv.tv_usec = 176000; /* Time to send one character 8*22ms */
-        tv.tv_usec = 100000; /* Timeout to send blank data every 100ms */
-        n = select(1, &rmask, NULL, NULL, &tv);
-        if (n > 0) {
-            read(0, &c, 1);
-            if (c == '\r' || c == '\n' ||
-                (ctx->column && ((ctx->column % COLUMN_MAX) == 0)))
-            {
-                encode_to_baudot(ctx, CHAR_CR);
-                encode_to_baudot(ctx, CHAR_LF);
-                printf("\r\n");
-                ctx->column = 0;
-            }
-            else {
-                print_char(ctx, c);
+
+static void file_close(rtty_conf *ctx)
+{
+    unsigned char hdr[WAV_HEADER_SIZE];
+
+    /* Patch in the real lengths when the output is seekable */
+    if (ctx->wav && ctx->out_bytes <= 0xffffffff - WAV_HEADER_SIZE &&
+        lseek(ctx->out_fd, 0, SEEK_SET) == 0) {
+        wav_header(ctx, hdr, ctx->out_bytes);
+        write_all(ctx->out_fd, hdr, sizeof(hdr));
+    }
+    if (ctx->out_fd != 1)
+        close(ctx->out_fd);
+    ctx->out_fd = -1;
+}
+
+
+/*
+ * Null and memory sinks: no device and no clock, for measuring pure
+ * synthesis throughput and for hosts without a sound card.
+ */
+static int null_open(rtty_conf *ctx)
+{
+    ctx->frames = FILE_FRAMES;
+    clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+    return 0;
+}
+
+
+static void null_write(rtty_conf *ctx, const unsigned char *buf, int frames)
+{
+}
+
+
+static void mem_write(rtty_conf *ctx, const unsigned char *buf, int frames)
+{
+    long long len = (long long) frames * ctx->frame_size;
+    unsigned char *mem;
+
+    if (ctx->out_bytes + len > ctx->mem_size) {
+        ctx->mem_size = 2 * (ctx->out_bytes + len);
+        mem = (unsigned char *) realloc(ctx->mem, ctx->mem_size);
+        if (mem == NULL) {
+            perror("realloc mem");
+            exit(1);
+        }
+        ctx->mem = mem;
+    }
+    memcpy(ctx->mem + ctx->out_bytes, buf, len);
+    ctx->out_bytes += len;
+}
+
+
+static void null_close(rtty_conf *ctx)
+{
+    struct timespec now;
+    double secs;
+    double air;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - ctx->start.tv_sec) +
+           (now.tv_nsec - ctx->start.tv_nsec) / 1e9;
+    air = (double) ctx->write_total / ctx->speed;
+    fprintf(stderr, "%s: %lu frames (%.1f s of audio) in %.3f s, "
+            "%.0fx real time, %s tones\n", ctx->sink->name,
+            (unsigned long) ctx->write_total, air, secs,
+            secs > 0 ? air / secs : 0.0, ctx->tone_name);
+    free(ctx->mem);
+    ctx->mem = NULL;
+}
+
+
+static int alsa_setup(rtty_conf *ctx, snd_pcm_access_t access)
+{
+    int sts;
+    unsigned int phase;
+    int size;
+    int e1;
+
+    if ((sts = set_hwparams(ctx, access)) < 0) {
+            printf("Setting of hwparams failed: %s\n", snd_strerror(sts));
+            return sts;
+    }
+    ctx->native_rate = 0;
+    ctx->native_format = 0;
+    ctx->bits = snd_pcm_format_physical_width(ctx->format);
+    ctx->frame_size = channels * ctx->bits / 8;
+    render_select(ctx);
+    if ((sts = set_swparams(ctx)) < 0) {
+            printf("Setting of swparams failed: %s\n", snd_strerror(sts));
+            exit(EXIT_FAILURE);
+    }
+
+    /* Write whole periods, never more than the ring holds */
+    if (ctx->write_periods > ctx->buffer_size / ctx->period_size)
+        ctx->write_periods = ctx->buffer_size / ctx->period_size;
+    if (ctx->write_periods < 1)
+        ctx->write_periods = 1;
+    ctx->frames = ctx->period_size * ctx->write_periods;
+    ctx->start_frames = (ctx->buffer_size / ctx->period_size) * ctx->period_size;
+    ctx->PCM_MAX = snd_pcm_avail_update(ctx->pcm);
+    ctx->bufsize = ctx->frames * ctx->frame_size;
+
+    /* Room for the 100 ms periods --latency may back off to, as pcm_alloc */
+    size = ctx->period_size * ctx->frame_size;
+    if (size > ctx->primecap) {
+        if (ctx->latency_ms && size < ctx->speed / 10 * ctx->frame_size)
+            size = ctx->speed / 10 * ctx->frame_size;
+        free(ctx->prime);
+        ctx->prime = (unsigned char *) malloc(size);
+        if (ctx->prime == NULL) {
+            perror("malloc prime");
+            exit(1);
+        }
+        ctx->primecap = size;
+    }
+    phase = ctx->phase;
+    e1 = ctx->speed/2;
+    render_tone(ctx, ctx->freq_high, ctx->period_size, &e1, ctx->prime);
+    ctx->phase = phase;
+    return 0;
+}
+
+
+/*
+ * --latency: ask for a ring of that length in four periods, the
+ * smallest the device will give.
+ */
+static void alsa_latency(rtty_conf *ctx)
+{
+    if (ctx->latency_ms) {
+        ctx->buffer_time = ctx->latency_ms * 1000;
+        ctx->period_time = ctx->buffer_time / 4;
+    }
+}
+
+
+/*
+ * Low latency mode backs off after an xrun: the period and buffer are
+ * doubled and renegotiated, up to the normal 100 ms periods. Called
+ * from the keyboard loop between characters; the last keystroke may
+ * still be queued, so it is drained rather than dropped.
+ */
+static int alsa_backoff(rtty_conf *ctx)
+{
+    unsigned char *buf;
+
+    if (ctx->period_time >= 100000)
+        return -1;
+
+    ctx->period_time *= 2;
+    if (ctx->period_time > 100000)
+        ctx->period_time = 100000;
+    ctx->buffer_time = 4 * ctx->period_time;
+    if (snd_pcm_drain(ctx->pcm) < 0)
+        snd_pcm_drop(ctx->pcm);
+    if (alsa_setup(ctx, ctx->sink->begin ? SND_PCM_ACCESS_MMAP_INTERLEAVED :
+                                           SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+        exit(EXIT_FAILURE);
+
+    if (ctx->sink->begin == NULL && ctx->bufsize > ctx->bufcap) {
+        buf = (unsigned char *) realloc(ctx->buf, ctx->bufsize);
+        if (buf == NULL) {
+            perror("realloc buf");
+            exit(1);
+        }
+        ctx->buf = buf;
+        ctx->bufcap = ctx->bufsize;
+    }
+    fprintf(stderr, "xrun: period now %lu frames, buffer %lu frames\n",
+            (unsigned long) ctx->period_size, (unsigned long) ctx->buffer_size);
+    return 0;
+}
+
+
+/*
+ * Whether the PCM takes one of native_formats as it is. Opened with
+ * SND_PCM_NO_AUTO_FORMAT, a plug device offers only the formats of the
+ * device below it rather than everything it can convert.
+ */
+static int alsa_native_format(rtty_conf *ctx)
+{
+    int i;
+
+    if (snd_pcm_hw_params_any(ctx->pcm, ctx->hwparams) < 0)
+        return 0;
+    for (i = 0; native_formats[i] != SND_PCM_FORMAT_UNKNOWN; i++) {
+        if (snd_pcm_hw_params_test_format(ctx->pcm, ctx->hwparams,
+                                          native_formats[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+static int alsa_pcm_open(rtty_conf *ctx)
+{
+    int mode;
+    int sts;
+
+    if (snd_pcm_hw_params_malloc(&ctx->hwparams) < 0 ||
+        snd_pcm_sw_params_malloc(&ctx->swparams) < 0) {
+        perror("malloc hw/sw params");
+        exit(1);
+    }
+    /* Without --bits, look for the format below any plug conversion */
+    mode = ctx->native_format ? SND_PCM_NO_AUTO_FORMAT : 0;
+    sts = snd_pcm_open(&ctx->pcm, ctx->output, SND_PCM_STREAM_PLAYBACK, mode);
+    if (sts == 0 && mode && !alsa_native_format(ctx)) {
+        snd_pcm_close(ctx->pcm);
+        sts = -EINVAL;
+    }
+    if (sts && mode)
+        sts = snd_pcm_open(&ctx->pcm, ctx->output, SND_PCM_STREAM_PLAYBACK, 0);
+    if (sts)
+    {
+        printf("alsa_init: failed %d\n", sts);
+        snd_pcm_hw_params_free(ctx->hwparams);
+        snd_pcm_sw_params_free(ctx->swparams);
+        return -1;
+    }
+    ctx->xruns = 0;
+    ctx->short_writes = 0;
+    ctx->dropped = 0;
+    ctx->primed = 0;
+    alsa_latency(ctx);
+    return 0;
+}
+
+
+static int alsa_open(rtty_conf *ctx)
+{
+    if (alsa_pcm_open(ctx) < 0)
+        return -1;
+    if (alsa_setup(ctx, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+        exit(EXIT_FAILURE);
+    return 0;
+}
+
+
+/*
+ * After recovering from an xrun the ring is empty. Queue a period of
+ * mark (the line idle state) ahead of the interrupted data, so the
+ * receiver sees steady stop polarity rather than a gap followed by a
+ * partial buffer.
+ */
+static void alsa_prime(rtty_conf *ctx)
+{
+    int sts;
+
+    sts = snd_pcm_writei(ctx->pcm, ctx->prime, ctx->period_size);
+    if (sts > 0)
+        ctx->primed += sts;
+}
+
+
+/*
+ * Deliver every frame: short writes are resubmitted, xruns and
+ * suspends go through snd_pcm_recover and the remainder of the
+ * buffer is sent after re-priming. Only an unrecoverable error drops
+ * frames.
+ */
+static void alsa_write(rtty_conf *ctx, const unsigned char *buf, int frames)
+{
+    int sts;
+
+    while (frames > 0) {
+        sts = snd_pcm_writei(ctx->pcm, buf, frames);
+        if (sts == -EAGAIN) {
+            snd_pcm_wait(ctx->pcm, 100);
+            continue;
+        }
+        if (sts < 0) {
+            if (sts == -EPIPE || sts == -ESTRPIPE)
+                ctx->xruns++;
+            if (snd_pcm_recover(ctx->pcm, sts, 1) < 0) {
+                printf("snd_pcm_writei: error %s\n", snd_strerror(sts));
+                ctx->dropped += frames;
+                return;
             }
-            fflush(stdout);
+            if (sts != -EINTR)
+                alsa_prime(ctx);
+            continue;
         }
-        else {
-            /* 
-             * Feedback loop to prevent PCM underrun when no data is
-             * entered from the keyboard. Send 150ms worth of blank
-             * data. This is slightly more than the select() timeout,
-             * so an underrun should never happen.
-             */
-            pcm_bits = snd_pcm_avail_update(ctx->pcm);
-            if (pcm_bits > (ctx->PCM_MAX - ctx->speed/2))
-            {
-                write_freq_to_alsa(ctx, ctx->freq_high, 150);
+        if (sts < frames)
+            ctx->short_writes++;
+        buf += sts * ctx->frame_size;
+        frames -= sts;
+    }
+}
+
+
+/*
+ * mmap sink: samples are rendered straight into the ALSA ring buffer
+ * between snd_pcm_mmap_begin and snd_pcm_mmap_commit, with no copy
+ * and no write call. Devices that refuse mmap access fall back to the
+ * read/write sink.
+ */
+static int mmap_open(rtty_conf *ctx)
+{
+    if (alsa_pcm_open(ctx) < 0)
+        return -1;
+    if (alsa_setup(ctx, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+        fprintf(stderr, "mmap access not available, using read/write\n");
+        if (alsa_setup(ctx, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+            exit(EXIT_FAILURE);
+        ctx->sink = sink_find("alsa");
+    }
+    return 0;
+}
+
+
+/* Copy the mark tone period into the emptied ring, as alsa_prime() */
+static void mmap_prime(rtty_conf *ctx)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t size;
+    snd_pcm_sframes_t sts;
+    int done = 0;
+
+    while (done < ctx->period_size) {
+        size = ctx->period_size - done;
+        if (snd_pcm_mmap_begin(ctx->pcm, &areas, &offset, &size) < 0)
+            return;
+        memcpy((unsigned char *) areas[0].addr +
+               (areas[0].first + offset * areas[0].step) / 8,
+               ctx->prime + done * ctx->frame_size, size * ctx->frame_size);
+        sts = snd_pcm_mmap_commit(ctx->pcm, offset, size);
+        if (sts <= 0)
+            return;
+        done += sts;
+        ctx->primed += sts;
+    }
+}
+
+
+static void mmap_recover(rtty_conf *ctx, int err)
+{
+    if (err == -EPIPE || err == -ESTRPIPE)
+        ctx->xruns++;
+    if (snd_pcm_recover(ctx->pcm, err, 1) < 0) {
+        printf("mmap: error %s\n", snd_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    if (err != -EINTR && err != -EAGAIN)
+        mmap_prime(ctx);
+}
+
+
+static unsigned char *mmap_begin(rtty_conf *ctx, int *frames)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t size;
+    snd_pcm_sframes_t avail;
+    int sts;
+
+    for (;;) {
+        avail = snd_pcm_avail_update(ctx->pcm);
+        if (avail < 0) {
+            mmap_recover(ctx, avail);
+            continue;
+        }
+        if (avail < ctx->frames) {
+            /* The ring is full: start the stream or wait for room */
+            if (!ctx->hold_start &&
+                snd_pcm_state(ctx->pcm) == SND_PCM_STATE_PREPARED) {
+                sts = snd_pcm_start(ctx->pcm);
+                if (sts < 0)
+                    mmap_recover(ctx, sts);
+            }
+            else {
+                sts = snd_pcm_wait(ctx->pcm, 1000);
+                if (sts < 0)
+                    mmap_recover(ctx, sts);
             }
+            continue;
         }
-    } while (c != 'Z');
-    tcsetattr(0, TCSANOW, &old);
+
+        size = ctx->frames;
+        sts = snd_pcm_mmap_begin(ctx->pcm, &areas, &offset, &size);
+        if (sts < 0) {
+            mmap_recover(ctx, sts);
+            continue;
+        }
+        ctx->mmap_offset = offset;
+        *frames = size;
+        return (unsigned char *) areas[0].addr +
+               (areas[0].first + offset * areas[0].step) / 8;
+    }
+}
+
+
+static void mmap_write(rtty_conf *ctx, const unsigned char *buf, int frames)
+{
+    snd_pcm_sframes_t sts;
+
+    sts = snd_pcm_mmap_commit(ctx->pcm, ctx->mmap_offset, frames);
+    if (sts < 0 || sts != frames) {
+        ctx->dropped += frames - (sts > 0 ? sts : 0);
+        mmap_recover(ctx, sts >= 0 ? -EPIPE : sts);
+    }
+
+    /* A commit doesn't apply the start threshold, start by hand */
+    if (!ctx->hold_start &&
+        snd_pcm_state(ctx->pcm) == SND_PCM_STATE_PREPARED &&
+        ctx->buffer_size - snd_pcm_avail_update(ctx->pcm) >= ctx->start_frames) {
+        sts = snd_pcm_start(ctx->pcm);
+        if (sts < 0)
+            mmap_recover(ctx, sts);
+    }
+}
+
+
+static void alsa_close(rtty_conf *ctx)
+{
+    if (ctx->xruns || ctx->short_writes || ctx->dropped) {
+        fprintf(stderr, "alsa: %d xruns, %d short writes, %lu frames dropped,"
+                " %lu mark frames inserted\n", ctx->xruns, ctx->short_writes,
+                ctx->dropped, ctx->primed);
+    }
+    free(ctx->prime);
+    ctx->prime = NULL;
+    ctx->primecap = 0;
+    snd_pcm_drain(ctx->pcm);
+    snd_pcm_close(ctx->pcm);
+    snd_pcm_hw_params_free(ctx->hwparams);
+    snd_pcm_sw_params_free(ctx->swparams);
+    ctx->pcm = NULL;
+}
+
+
+/*
+ * Keep only frames queued in the ring: start playback once that much
+ * is queued and wake poll() as soon as the queue drops below it.
+ */
+static int alsa_set_fill(rtty_conf *ctx, snd_pcm_uframes_t frames)
+{
+    int err;
+
+    if (frames > ctx->buffer_size)
+        frames = ctx->buffer_size;
+    ctx->start_frames = frames;
+    err = snd_pcm_sw_params_current(ctx->pcm, ctx->swparams);
+    if (err < 0)
+        return err;
+    err = snd_pcm_sw_params_set_start_threshold(ctx->pcm, ctx->swparams,
+                                                frames);
+    if (err < 0)
+        return err;
+    err = snd_pcm_sw_params_set_avail_min(ctx->pcm, ctx->swparams,
+                  frames < ctx->buffer_size ? ctx->buffer_size - frames : 1);
+    if (err < 0)
+        return err;
+    return snd_pcm_sw_params(ctx->pcm, ctx->swparams);
+}
+
+
+/*
+ * Start playback once frames are queued; 0 never starts it, so that
+ * only snd_pcm_start does.
+ */
+static int alsa_set_start(rtty_conf *ctx, snd_pcm_uframes_t frames)
+{
+    snd_pcm_uframes_t boundary;
+    int err;
+
+    err = snd_pcm_sw_params_current(ctx->pcm, ctx->swparams);
+    if (err < 0)
+        return err;
+    if (frames == 0) {
+        err = snd_pcm_sw_params_get_boundary(ctx->swparams, &boundary);
+        if (err < 0)
+            return err;
+        frames = boundary;
+    }
+    err = snd_pcm_sw_params_set_start_threshold(ctx->pcm, ctx->swparams,
+                                                frames);
+    if (err < 0)
+        return err;
+    return snd_pcm_sw_params(ctx->pcm, ctx->swparams);
+}
+
+
+/* Frames queued for playback, including those not yet handed over */
+static long pcm_queued(rtty_conf *ctx)
+{
+    snd_pcm_sframes_t avail;
+
+    avail = snd_pcm_avail_update(ctx->pcm);
+    if (avail < 0 || avail > ctx->buffer_size)
+        avail = ctx->buffer_size;    /* xrun, the ring has run dry */
+    return ctx->buffer_size - avail + ctx->bufidx / ctx->frame_size;
+}
+
+
+static const rtty_sink sinks[] = {
+    { "alsa",   alsa_open, alsa_write, alsa_close, NULL },
+    { "mmap",   mmap_open, mmap_write, alsa_close, mmap_begin },
+    { "file",   file_open, file_write, file_close, NULL },
+    { "null",   null_open, null_write, null_close, NULL },
+    { "memory", null_open, mem_write,  null_close, NULL },
+};
+
+/* Collects a message being rendered into the message cache */
+static const rtty_sink capture_sink =
+    { "capture", NULL, mem_write, NULL, NULL };
+
+
+const rtty_sink *sink_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        if (!strcmp(sinks[i].name, name))
+            return &sinks[i];
+    }
+    return NULL;
+}
+
+/*
+ * Queue an operation for the render thread, waiting about a character
+ * time whenever the ring is full.
+ */
+void render_put(rtty_conf *ctx, int op, int freq, int arg)
+{
+    rtty_render *r;
+    struct timespec ts = { 0, 20 * 1000000 };
+    unsigned int head;
+
+    /* With several devices, each thread gets the same operations */
+    for (r = ctx->render; r; r = r->next) {
+        head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&r->tail, memory_order_acquire) >=
+               QUEUE_SIZE) {
+            nanosleep(&ts, NULL);
+        }
+        r->ops[head & (QUEUE_SIZE - 1)].op = op;
+        r->ops[head & (QUEUE_SIZE - 1)].freq = freq;
+        r->ops[head & (QUEUE_SIZE - 1)].arg = arg;
+        atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    }
+}
+
+
+/* The most operations any device's thread has yet to take */
+static unsigned int render_depth(rtty_conf *ctx)
+{
+    rtty_render *r;
+    unsigned int depth = 0;
+    unsigned int n;
+
+    for (r = ctx->render; r; r = r->next) {
+        n = atomic_load_explicit(&r->head, memory_order_relaxed) -
+            atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (n > depth)
+            depth = n;
+    }
+    return depth;
+}
+
+
+static int render_get(rtty_render *r, rtty_op *op)
+{
+    unsigned int tail;
+
+    tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+        return 0;
+    *op = r->ops[tail & (QUEUE_SIZE - 1)];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+
+/*
+ * --link: fill the ring with mark, holding the device stopped, and
+ * wait for every other device to do the same. The first then starts
+ * them all at once through the link, while the others wait again so
+ * that none can start the group itself. Once started each leaves the
+ * link, so that an xrun or the drain at close touches that device
+ * alone, and goes back to its normal start threshold for restarts.
+ */
+static void render_linked_start(rtty_render *r)
+{
+    rtty_conf *ctx = &r->ctx;
+    int err;
+
+    ctx->hold_start = 1;
+    err = alsa_set_start(ctx, 0);
+    if (err < 0)
+        printf("%s: unable to hold start: %s\n", ctx->output,
+               snd_strerror(err));
+    write_tone_frames(ctx, ctx->freq_high, ctx->start_frames);
+    if (ctx->bufidx)
+        pcm_flush(ctx);
+
+    pthread_barrier_wait(r->start);
+    if (r->leader) {
+        err = snd_pcm_start(ctx->pcm);
+        if (err < 0)
+            printf("%s: snd_pcm_start: %s\n", ctx->output,
+                   snd_strerror(err));
+    }
+    pthread_barrier_wait(r->start);
+    err = snd_pcm_unlink(ctx->pcm);
+    if (err < 0)
+        printf("%s: snd_pcm_unlink: %s\n", ctx->output, snd_strerror(err));
+    ctx->hold_start = 0;
+    alsa_set_start(ctx, ctx->start_frames);
+}
+
+
+static void *render_thread(void *arg)
+{
+    rtty_render *r = (rtty_render *) arg;
+    rtty_conf *ctx = &r->ctx;
+    struct timespec ts = { 0, 1000000 };
+    rtty_op op;
+    if (ctx->realtime)
+        realtime_setup(ctx);
+    if (r->start)
+        render_linked_start(r);
+
+    for (;;) {
+        if (!render_get(r, &op)) {
+            /* Keep the carrier up on a live device, else just wait */
+            if (ctx->pcm)
+                write_tone_frames(ctx, ctx->freq_high, bit_frames(ctx, 100));
+            else
+                nanosleep(&ts, NULL);
+            continue;
+        }
+        switch (op.op) {
+          case OP_SYMBOL:
+            encode_to_baudot(ctx, op.arg);
+            break;
+          case OP_TONE:
+            write_freq_to_alsa(ctx, op.freq, op.arg);
+            break;
+          case OP_CACHED:
+            msgcache_play(ctx, op.arg);
+            break;
+          case OP_STOP:
+            sink_close(ctx);
+            return NULL;
+        }
+    }
+}
+
+
+/*
+ * Start a render thread for the open sink in dev, on the end of the
+ * list ctx queues to. The first one started leads a --link start.
+ */
+static void render_add(rtty_conf *ctx, rtty_conf *dev,
+                       pthread_barrier_t *start)
+{
+    rtty_render *r;
+    rtty_render **tail;
+    int err;
+
+    r = (rtty_render *) calloc(1, sizeof(rtty_render));
+    if (r == NULL) {
+        perror("calloc render");
+        exit(1);
+    }
+    r->ctx = *dev;
+    r->ctx.render = NULL;
+    r->start = start;
+    r->leader = ctx->render == NULL;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    for (tail = &ctx->render; *tail; tail = &(*tail)->next)
+        ;
+    *tail = r;
+
+    err = pthread_create(&r->thread, NULL, render_thread, r);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+
+/*
+ * Hand the open sink to a render thread. From here on ctx is only
+ * used on the input side and queues its output.
+ */
+void render_start(rtty_conf *ctx, pthread_barrier_t *start)
+{
+    render_add(ctx, ctx, start);
+    ctx->pcm = NULL;
+    ctx->buf = NULL;
+    ctx->symcache = NULL;
+}
+
+
+/*
+ * Several --output-dev: each further device is opened from a copy of
+ * ctx, so at the rate and format the first one settled on, and has a
+ * render thread of its own. They share costab and everything queued
+ * goes to all of them. With --link they are joined by snd_pcm_link
+ * just to be started together once every ring is full, so all key in
+ * step.
+ */
+void devices_start(rtty_conf *ctx, int link)
+{
+    static rtty_conf dev[MAX_DEVICES];
+    static pthread_barrier_t barrier;
+    int err;
+    int i;
+
+    if (ctx->pcm == NULL) {
+        fprintf(stderr, "Several --output-dev need the alsa or mmap sink\n");
+        exit(1);
+    }
+    for (i = 1; i < device_count; i++) {
+        dev[i] = *ctx;
+        dev[i].output = devices[i];
+        dev[i].pcm = NULL;
+        dev[i].hwparams = NULL;
+        dev[i].swparams = NULL;
+        dev[i].prime = NULL;
+        dev[i].primecap = 0;
+        dev[i].buf = NULL;
+        dev[i].symcache = NULL;
+        dev[i].sympool = NULL;
+        dev[i].write_total = 0;
+        if (ctx->stats) {
+            dev[i].stats = (rtty_stats *) calloc(1, sizeof(rtty_stats));
+            if (dev[i].stats == NULL) {
+                perror("calloc stats");
+                exit(1);
+            }
+        }
+        if (dev[i].sink->open(&dev[i]) < 0)
+            exit(1);
+        pcm_alloc(&dev[i]);
+        if (link) {
+            err = snd_pcm_link(ctx->pcm, dev[i].pcm);
+            if (err < 0) {
+                fprintf(stderr, "snd_pcm_link %s: %s\n", devices[i],
+                        snd_strerror(err));
+                exit(1);
+            }
+        }
+    }
+
+    if (link)
+        pthread_barrier_init(&barrier, NULL, device_count);
+    render_start(ctx, link ? &barrier : NULL);
+    for (i = 1; i < device_count; i++)
+        render_add(ctx, &dev[i], link ? &barrier : NULL);
+}
+
+
+/* Wait for everything queued to be sent, then close the sinks */
+void render_stop(rtty_conf *ctx)
+{
+    rtty_render *r;
+
+    render_put(ctx, OP_STOP, 0, 0);
+    while ((r = ctx->render) != NULL) {
+        pthread_join(r->thread, NULL);
+        ctx->render = r->next;
+        free(r);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    int i;
+    int test_data = 0;
+    int keyboard = 0;
+    int stream = 0;
+    char *socket_path = NULL;
+    char *encode_path = NULL;
+    char *replay_path = NULL;
+    char *end;
+    int link = 0;
+    int channels = 1;
+    rtty_conf ctx = {0};
+
+    for(i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' ||
+           argv[i][1] != '-')
+            break;
+
+        if (!strcmp(argv[i], "--keyboard")) {
+            keyboard = 1;
+        }
+        else if (!strcmp(argv[i], "--stdin")) {
+            stream = 1;
+        }
+        else if (!strcmp(argv[i], "--cache-dir")) {
+            i++;
+            if (i >= argc)
+                Usage();
+            ctx.cache_dir = argv[i];
+        }
+        else if (!strcmp(argv[i], "--macro")) {
+            i++;
+            if (i >= argc || !isdigit((unsigned char) argv[i][0]) ||
+                argv[i][1] != ':')
+                Usage();
+            ctx.macro[argv[i][0] - '0'] = argv[i] + 2;
+        }
+        else if (!strcmp(argv[i], "--vft-channel")) {
+            i++;
+            if (i >= argc || vft_count >= VFT_CHANNELS)
+                Usage();
+            vft[vft_count].freq = strtol(argv[i], &end, 10);
+            if (*end != ':' || end[1] == '\0' ||
+                vft[vft_count].freq < 300 || vft[vft_count].freq > 3400)
+                Usage();
+            vft[vft_count++].input = end + 1;
+        }
+        else if (!strcmp(argv[i], "--encode")) {
+            i++;
+            if (i >= argc)
+                Usage();
+            encode_path = argv[i];
+        }
+        else if (!strcmp(argv[i], "--replay")) {
+            i++;
+            if (i >= argc)
+                Usage();
+            replay_path = argv[i];
+        }
+        else if (!strcmp(argv[i], "--daemon")) {
+            i++;
+            if (i >= argc)
+                Usage();
+            socket_path = argv[i];
+        }
+        else if (!strcmp(argv[i], "--test-data")) {
+            test_data = 1;
+        }
+        else if (!strcmp(argv[i], "--threads")) {
+            ctx.threads = 1;
+        }
+        else if (!strcmp(argv[i], "--realtime")) {
+            getvalue(&ctx.realtime, &i, argc, argv,
+                 1, 99);
+        }
+        else if (!strcmp(argv[i], "--stats")) {
+            ctx.stats = (rtty_stats *) calloc(1, sizeof(rtty_stats));
+            if (ctx.stats == NULL) {
+                perror("calloc stats");
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--wav")) {
+            ctx.wav = 1;
+        }
+        else if (!strcmp(argv[i], "--volume")) {
+            getvalue(&ctx.volume, &i, argc, argv,
+                 0, 100);
+            ctx.volume_set = 1;
+        }
+        else if (!strcmp(argv[i], "--table-bits")) {
+            getvalue(&ctx.table_bits, &i, argc, argv,
+                 4, 12);
+        }
+        else if (!strcmp(argv[i], "--nco-report")) {
+            ctx.nco_report = 1;
+        }
+        else if (!strcmp(argv[i], "--speed")) {
+            getvalue(&ctx.speed, &i, argc, argv,
+                 5000, 192000);
+        }
+        else if (!strcmp(argv[i], "--wpm")) {
+            getvalue(&ctx.wpm, &i, argc, argv,
+                 10, 10000);
+        }
+        else if (!strcmp(argv[i], "--baud")) {
+            getvalue_x100(&ctx.baud, &i, argc, argv,
+                 1000, 100000);
+        }
+        else if (!strcmp(argv[i], "--usos")) {
+            ctx.usos = 1;
+        }
+        else if (!strcmp(argv[i], "--stop")) {
+            getvalue_x100(&ctx.stop_len, &i, argc, argv,
+                 100, 200);
+        }
+        else if (!strcmp(argv[i], "--shift")) {
+            getvalue(&ctx.fsk_shift, &i, argc, argv,
+                 10, 1000);
+        }
+        else if (!strcmp(argv[i], "--freq")) {
+            getvalue(&ctx.freq_low, &i, argc, argv,
+                 500, 3000);
+        }
+        else if (!strcmp(argv[i], "--bits")) {
+            getvalue(&ctx.bits, &i, argc, argv,
+                 8, 32);
+        }
+        else if (!strcmp(argv[i], "--float")) {
+            ctx.use_float = 1;
+            ctx.bits = 32;
+        }
+        else if (!strcmp(argv[i], "--no-simd")) {
+            ctx.no_simd = 1;
+        }
+        else if (!strcmp(argv[i], "--write-periods")) {
+            getvalue(&ctx.write_periods, &i, argc, argv,
+                 1, 16);
+        }
+        else if (!strcmp(argv[i], "--fill-ms")) {
+            getvalue(&ctx.fill_ms, &i, argc, argv,
+                 10, 2000);
+        }
+        else if (!strcmp(argv[i], "--latency")) {
+            getvalue(&ctx.latency_ms, &i, argc, argv,
+                 5, 500);
+        }
+        else if (!strcmp(argv[i], "--idle")) {
+            i++;
+            if (i >= argc)
+                Usage();
+            if (!strcmp(argv[i], "ltrs"))
+                ctx.idle_ltrs = 1;
+            else if (strcmp(argv[i], "mark"))
+                Usage();
+        }
+        else if (!strcmp(argv[i], "--use-audio")) {
+            getvalue(&ctx.use_audio, &i, argc, argv,
+                 0, 1);
+        }
+        else if (!strcmp(argv[i], "--input-file")) {
+            i++;
+            if (i >= argc)
+                Usage();
+            ctx.filename = argv[i];
+        }
+        else if (!strcmp(argv[i], "--output-dev")) {
+            i++;
+            if (i >= argc || device_count >= MAX_DEVICES)
+                Usage();
+            devices[device_count++] = argv[i];
+            ctx.output = devices[0];
+        }
+        else if (!strcmp(argv[i], "--link")) {
+            link = 1;
+        }
+        else if (!strcmp(argv[i], "--sink")) {
+            i++;
+            if (i >= argc)
+                Usage();
+            ctx.sink = sink_find(argv[i]);
+            if (!ctx.sink)
+                Usage();
+        }
+        else if (!strcmp(argv[i], "--output-file")) {
+            i++;
+            if (i >= argc)
+                Usage();
+            ctx.output_file = argv[i];
+        }
+        else {
+            Usage();
+        }
+    }
+
+    /* A replayed file brings its own framing, unless overridden */
+    if (replay_path && ita2_header(&ctx, replay_path) < 0)
+        return 1;
+    rtty_conf_init(&ctx);
+    baudot_table_init();
+    if (encode_path)
+        return ita2_encode(&ctx, encode_path, argc - i, argv + i);
+
+    switch(ctx.bits) {
+        case 8:
+            ctx.format = SND_PCM_FORMAT_U8;
+            break;
+        case 16:
+            ctx.format = SND_PCM_FORMAT_S16_LE;
+            break;
+        case 24:
+            ctx.format = SND_PCM_FORMAT_S24_3LE;
+            break;
+        case 32:
+            ctx.format = ctx.use_float ? SND_PCM_FORMAT_FLOAT_LE :
+                                         SND_PCM_FORMAT_S32_LE;
+            break;
+        default:
+            fprintf(stderr, "Value for bits should be 8, 16, 24 or 32\n");
+            return(1);
+    }
+    /* Every device is fed by its own render thread */
+    if (device_count > 1)
+        ctx.threads = 1;
+    if (vft_count && ctx.threads) {
+        fprintf(stderr, "--vft-channel cannot be used with --threads "
+                "or several --output-dev\n");
+        return(1);
+    }
+
+    ctx.frame_size = channels * snd_pcm_format_physical_width(ctx.format) / 8;
+    render_select(&ctx);
+    tone_select(&ctx);
+
+    if (ctx.sink == NULL) {
+        if (ctx.output_file || strcmp(ctx.output, "-") == 0)
+            ctx.sink = sink_find("file");
+        else
+            ctx.sink = sink_find("alsa");
+    }
+    gen_costab(&ctx);
+    if (ctx.sink->open(&ctx) < 0)
+        return 1;
+
+    pcm_alloc(&ctx);
+
+    if (device_count > 1)
+        devices_start(&ctx, link);
+    else if (ctx.threads)
+        render_start(&ctx, NULL);
+    else if (ctx.realtime)
+        realtime_setup(&ctx);
+    if (ctx.realtime)
+        msgcache_macros(&ctx);
+
+    if (ctx.nco_report)
+        nco_report(&ctx);
+
+    if (vft_count) {
+        vft_run(&ctx);
+        sink_close(&ctx);
+        return 0;
+    }
+
+    /* Load data into ALSA sound buffer */
+    write_freq_to_alsa(&ctx, ctx.freq_high, 500);
+
+    if (test_data) {
+        test_generator(&ctx);
+    }
+    else {
+        pause_print(&ctx, 10);
+        initialize_tty(&ctx);
+
+        if (keyboard) 
+        {
+            keyboard_io(&ctx);
+        }
+        else if (stream)
+        {
+            stdin_io(&ctx);
+        }
+        else if (socket_path)
+        {
+            daemon_io(&ctx, socket_path);
+        }
+        else if (replay_path)
+        {
+            ita2_replay(&ctx, replay_path);
+        }
+        else if (ctx.filename) {
+            print_file(&ctx, ctx.filename);
+        }
+        else {
+            send_words(&ctx, argc - i, argv + i);
+        }
+
+        initialize_tty(&ctx);
+        pause_print(&ctx, 10);
+    }
+    if (ctx.render)
+        render_stop(&ctx);
+    else
+        sink_close(&ctx);
+    return 0;
+}
+
+
+/*
+ * Top the ring up to the fill target with idle: steady mark, or LTRS
+ * characters when --idle ltrs is given.
+ */
+static void idle_fill(rtty_conf *ctx, long target)
+{
+    long want;
+
+    if (ctx->idle_ltrs) {
+        while (pcm_queued(ctx) < target) {
+            encode_to_baudot(ctx, CHAR_SHIFT_DOWN);
+            ctx->shift = 0;
+        }
+    }
+    else {
+        want = target - pcm_queued(ctx);
+        if (want > 0)
+            write_tone_frames(ctx, ctx->freq_high, want);
+    }
+}
+
+
+/*
+ * Fill target for keyboard and --stdin modes: --fill-ms, or with
+ * --latency just the two periods needed to ride out one late wakeup.
+ */
+static long keyboard_fill(rtty_conf *ctx)
+{
+    long target;
+
+    if (ctx->latency_ms)
+        target = 2 * ctx->period_size;
+    else
+        target = (long) ctx->fill_ms * ctx->speed / 1000;
+    if (alsa_set_fill(ctx, target) < 0)
+        fprintf(stderr, "Unable to set fill level for playback\n");
+    return target;
+}
+
+
+/* The PCM's poll descriptors, as many as fit after stdin or a socket */
+static int pcm_poll_count(rtty_conf *ctx)
+{
+    int n;
+
+    n = snd_pcm_poll_descriptors_count(ctx->pcm);
+    return n > MAX_POLL_FDS ? MAX_POLL_FDS : n;
+}
+
+
+/*
+ * Send stdin as it arrives, keeping the ring topped up with idle
+ * while there is nothing to send. From the keyboard stdin is read
+ * raw, echoed and ended by 'Z'; otherwise it is read non-blocking
+ * until end of file. A single poll() waits on stdin and on the PCM,
+ * which is set up to wake us only when less than the fill target is
+ * queued, so input goes out behind at most that much idle. There are
+ * no timeouts, an idle station sleeps.
+ */
+static void input_io(rtty_conf *ctx, int keyboard)
+{
+    struct pollfd fds[1 + MAX_POLL_FDS];
+    unsigned short revents;
+    char input[BSIZE];
+    char c = 0;
+    int npcm = 0;
+    int n;
+    int i;
+    int xruns = 0;
+    int flags = 0;
+    int esc = 0;
+    long target = 0;
+    struct termios old;
+
+    if (ctx->pcm) {
+        target = keyboard_fill(ctx);
+        npcm = pcm_poll_count(ctx);
+        xruns = ctx->xruns;
+    }
+
+    if (keyboard) {
+        set_raw(0, &old);
+    }
+    else {
+        flags = fcntl(0, F_GETFL);
+        fcntl(0, F_SETFL, flags | O_NONBLOCK);
+    }
+    do {
+        fds[0].fd = 0;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        if (npcm > 0)
+            snd_pcm_poll_descriptors(ctx->pcm, fds + 1, npcm);
+
+        n = poll(fds, 1 + npcm, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            n = read(0, input, sizeof(input));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n <= 0)
+                break;
+            if (!keyboard) {
+                print_text(ctx, input, n);
+            }
+            for (i = 0; keyboard && i < n && c != 'Z'; i++) {
+                c = input[i];
+                if (esc) {
+                    /* ESC and a digit sends that macro */
+                    esc = 0;
+                    if (c >= '0' && c <= '9' && ctx->macro[c - '0']) {
+                        msgcache_send(ctx, ctx->macro[c - '0'],
+                                      strlen(ctx->macro[c - '0']));
+                        continue;
+                    }
+                }
+                if (c == 27) {
+                    esc = 1;
+                }
+                else if (c == '\r' || c == '\n' ||
+                    (ctx->column && ((ctx->column % COLUMN_MAX) == 0)))
+                {
+                    encode_to_baudot(ctx, CHAR_CR);
+                    encode_to_baudot(ctx, CHAR_LF);
+                    fputs("\r\n", ctx->tty);
+                    ctx->column = 0;
+                }
+                else {
+                    print_char(ctx, c);
+                }
+            }
+            fflush(ctx->tty);
+        }
+
+        if (npcm > 0) {
+            snd_pcm_poll_descriptors_revents(ctx->pcm, fds + 1, npcm,
+                                             &revents);
+            if (ctx->latency_ms && ctx->xruns != xruns && ctx->bufidx == 0) {
+                xruns = ctx->xruns;
+                if (alsa_backoff(ctx) == 0) {
+                    target = keyboard_fill(ctx);
+                    npcm = pcm_poll_count(ctx);
+                    revents = POLLOUT;
+                }
+            }
+            if (revents & (POLLOUT | POLLERR))
+                idle_fill(ctx, target);
+        }
+
+        /* Don't hold keystrokes back waiting for a full period */
+        if (ctx->bufidx)
+            pcm_flush(ctx);
+    } while (c != 'Z');
+    if (keyboard)
+        tcsetattr(0, TCSANOW, &old);
+    else
+        fcntl(0, F_SETFL, flags);
+}
+
+
+void keyboard_io(rtty_conf *ctx)
+{
+    input_io(ctx, 1);
+}
+
+
+void stdin_io(rtty_conf *ctx)
+{
+    input_io(ctx, 0);
+}
+
+
+/*
+ * Daemon mode. The PCM stays open and idling while messages arrive
+ * over a UNIX socket, one per connection, ending when the client
+ * closes it. A message whose first line is URGENT_MARK is queued
+ * ahead of routine traffic and takes the line over at the next
+ * character; the message it interrupted resumes after it.
+ */
+static volatile sig_atomic_t daemon_stop;
+
+
+static void daemon_signal(int sig)
+{
+    daemon_stop = 1;
+}
+
+
+static int daemon_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /* Clear a socket left by an earlier run, but nothing else */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, MAX_CLIENTS) < 0)
+    {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static rtty_msg *msg_alloc(void)
+{
+    rtty_msg *m;
+
+    m = (rtty_msg *) calloc(1, sizeof(rtty_msg));
+    if (m == NULL) {
+        perror("calloc msg");
+        exit(1);
+    }
+    return m;
+}
+
+
+static void msg_free(rtty_msg *m)
+{
+    free(m->text);
+    free(m);
+}
+
+
+/* Room for at least BSIZE more bytes of message text */
+static void msg_grow(rtty_msg *m)
+{
+    char *text;
+
+    if (m->alloc - m->size >= BSIZE)
+        return;
+    text = (char *) realloc(m->text, 2 * m->alloc + BSIZE);
+    if (text == NULL) {
+        perror("realloc msg");
+        exit(1);
+    }
+    m->text = text;
+    m->alloc = 2 * m->alloc + BSIZE;
+}
+
+
+/*
+ * Queue a complete message behind those of its own priority or
+ * higher; the marker line of an urgent message is not sent.
+ */
+static void msg_queue(rtty_msg **queue, rtty_msg *m)
+{
+    size_t n = strlen(URGENT_MARK);
+
+    if (m->size > n && !memcmp(m->text, URGENT_MARK, n) &&
+        (m->text[n] == '\n' || m->text[n] == '\r'))
+    {
+        m->urgent = 1;
+        m->sent = n + 1;
+        if (m->text[n] == '\r' && m->sent < m->size &&
+            m->text[m->sent] == '\n')
+            m->sent++;
+    }
+    if (m->sent >= m->size) {
+        msg_free(m);
+        return;
+    }
+
+    while (*queue && (*queue)->urgent >= m->urgent)
+        queue = &(*queue)->next;
+    m->next = *queue;
+    *queue = m;
+}
+
+
+void daemon_io(rtty_conf *ctx, const char *path)
+{
+    struct pollfd fds[1 + MAX_CLIENTS + MAX_POLL_FDS];
+    struct sigaction sa;
+    unsigned short revents;
+    int cfd[MAX_CLIENTS];
+    rtty_msg *cmsg[MAX_CLIENTS];
+    rtty_msg *queue = NULL;
+    rtty_msg *last = NULL;
+    rtty_msg *m;
+    int nclients = 0;
+    int polled;
+    int lfd;
+    int npcm = 0;
+    int wait;
+    int n;
+    int i;
+    int xruns = 0;
+    long target = 0;
+
+    lfd = daemon_listen(path);
+    if (lfd < 0)
+        return;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (ctx->pcm) {
+        target = keyboard_fill(ctx);
+        npcm = pcm_poll_count(ctx);
+        xruns = ctx->xruns;
+    }
+
+    while (!daemon_stop) {
+        /* With every slot taken, leave new connections in the backlog */
+        fds[0].fd = nclients < MAX_CLIENTS ? lfd : -1;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        for (i = 0; i < nclients; i++) {
+            fds[1 + i].fd = cfd[i];
+            fds[1 + i].events = POLLIN;
+            fds[1 + i].revents = 0;
+        }
+        polled = nclients;
+        if (npcm > 0)
+            snd_pcm_poll_descriptors(ctx->pcm, fds + 1 + polled, npcm);
+
+        /*
+         * Only look for new work between characters while sending. With
+         * --threads, stay a few symbols ahead of the renderer rather than
+         * filling its ring, so that an urgent message is not kept waiting.
+         */
+        wait = -1;
+        if (queue)
+            wait = render_depth(ctx) >= DAEMON_LEAD ? 20 : 0;
+        n = poll(fds, 1 + polled + npcm, wait);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            n = accept(lfd, NULL, NULL);
+            if (n >= 0) {
+                cfd[nclients] = n;
+                cmsg[nclients] = msg_alloc();
+                nclients++;
+            }
+        }
+
+        /* Downwards, so a finished client can be swapped with the last */
+        for (i = polled - 1; i >= 0; i--) {
+            if (!(fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            m = cmsg[i];
+            msg_grow(m);
+            n = read(cfd[i], m->text + m->size, m->alloc - m->size);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (n > 0) {
+                m->size += n;
+                continue;
+            }
+            if (n == 0)
+                msg_queue(&queue, m);
+            else
+                msg_free(m);
+            close(cfd[i]);
+            nclients--;
+            cfd[i] = cfd[nclients];
+            cmsg[i] = cmsg[nclients];
+        }
+
+        if (queue && render_depth(ctx) < DAEMON_LEAD) {
+            /* Start each message, and resume any, on a fresh line */
+            m = queue;
+            if (m != last && ctx->column)
+                print_text(ctx, "\n", 1);
+            last = m;
+            print_text(ctx, m->text + m->sent, 1);
+            if (++m->sent == m->size) {
+                queue = m->next;
+                if (ctx->column)
+                    print_text(ctx, "\n", 1);
+                msg_free(m);
+                last = NULL;
+            }
+        }
+
+        if (npcm > 0) {
+            snd_pcm_poll_descriptors_revents(ctx->pcm, fds + 1 + polled, npcm,
+                                             &revents);
+            if (ctx->latency_ms && ctx->xruns != xruns && ctx->bufidx == 0) {
+                xruns = ctx->xruns;
+                if (alsa_backoff(ctx) == 0) {
+                    target = keyboard_fill(ctx);
+                    npcm = pcm_poll_count(ctx);
+                    revents = POLLOUT;
+                }
+            }
+            if (!queue && (revents & (POLLOUT | POLLERR)))
+                idle_fill(ctx, target);
+        }
+
+        if (!queue && ctx->bufidx)
+            pcm_flush(ctx);
+    }
+
+    for (i = 0; i < nclients; i++) {
+        close(cfd[i]);
+        msg_free(cmsg[i]);
+    }
+    while (queue) {
+        m = queue;
+        queue = m->next;
+        msg_free(m);
+    }
+    close(lfd);
+    unlink(path);
+}
+
+
+/*
+ * --encode writes the symbols text would be sent as to a packed ITA2
+ * file, and --replay sends such a file. Shifts and line breaks are
+ * resolved when encoding, so replay only unpacks codes.
+ */
+static unsigned int get_le(const unsigned char *p, int len)
+{
+    unsigned int val = 0;
+
+    while (len-- > 0)
+        val = (val << 8) | p[len];
+    return val;
+}
+
+
+static void ita2_put(ita2_file *f, int code)
+{
+    f->bits |= code << f->nbits;
+    f->nbits += 5;
+    while (f->nbits >= 8) {
+        f->buf[f->len++] = f->bits & 0xff;
+        f->bits >>= 8;
+        f->nbits -= 8;
+        if (f->len == BSIZE) {
+            write_all(f->fd, f->buf, f->len);
+            f->len = 0;
+        }
+    }
+    f->codes++;
+}
+
+
+int ita2_encode(rtty_conf *ctx, const char *path, int count, char **words)
+{
+    unsigned char hdr[ITA2_HEADER_SIZE];
+    ita2_file *f;
+
+    f = (ita2_file *) calloc(1, sizeof(ita2_file));
+    if (f == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (f->fd < 0) {
+        perror(path);
+        free(f);
+        return 1;
+    }
+
+    /* Symbols, not samples: no cache, and no echo of the text */
+    ctx->ita2 = f;
+    ctx->cache_dir = NULL;
+    ctx->tty = fopen("/dev/null", "w");
+    if (ctx->tty == NULL) {
+        perror("/dev/null");
+        exit(1);
+    }
+    memset(hdr, 0, sizeof(hdr));
+    write_all(f->fd, hdr, sizeof(hdr));
+    if (ctx->filename)
+        print_file(ctx, ctx->filename);
+    else
+        send_words(ctx, count, words);
+    if (f->nbits)
+        f->buf[f->len++] = f->bits;
+    write_all(f->fd, f->buf, f->len);
+
+    memcpy(hdr, ITA2_MAGIC, 4);
+    hdr[4] = ITA2_VERSION;
+    hdr[5] = ctx->usos ? ITA2_USOS : 0;
+    put_le(hdr + 6, ctx->stop_len, 2);
+    put_le(hdr + 8, ctx->baud, 4);
+    put_le(hdr + 12, f->codes, 4);
+    if (lseek(f->fd, 0, SEEK_SET) == 0)
+        write_all(f->fd, hdr, sizeof(hdr));
+    else
+        perror("lseek");
+
+    fprintf(stderr, "%s: %lu codes in %ld bytes\n", path, f->codes,
+            (long) (ITA2_HEADER_SIZE + (f->codes * 5 + 7) / 8));
+    close(f->fd);
+    fclose(ctx->tty);
+    free(f);
+    return 0;
+}
+
+
+/*
+ * Read the header of an ITA2 file, taking its framing where the
+ * command line gave none.
+ */
+int ita2_header(rtty_conf *ctx, const char *path)
+{
+    unsigned char hdr[ITA2_HEADER_SIZE];
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (read(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr, ITA2_MAGIC, 4) || hdr[4] != ITA2_VERSION)
+    {
+        fprintf(stderr, "%s: not an ITA2 file\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (ctx->baud == 0)
+        ctx->baud = get_le(hdr + 8, 4);
+    if (ctx->stop_len == 0)
+        ctx->stop_len = get_le(hdr + 6, 2);
+    if (hdr[5] & ITA2_USOS)
+        ctx->usos = 1;
+    return 0;
+}
+
+
+void ita2_replay(rtty_conf *ctx, const char *path)
+{
+    signed char symbol[32];
+    unsigned char *map;
+    unsigned long codes;
+    unsigned long n;
+    unsigned int bits = 0;
+    struct stat st;
+    int shift = SHIFT_LTRS;
+    int nbits = 0;
+    int sym;
+    int pos;
+    int fd;
+    char c;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    codes = get_le(map + 12, 4);
+    if (st.st_size < ITA2_HEADER_SIZE + (codes * 5 + 7) / 8) {
+        fprintf(stderr, "%s: truncated\n", path);
+        codes = (st.st_size - ITA2_HEADER_SIZE) * 8 / 5;
+    }
+
+    for (sym = 0; sym <= CHAR_SHIFT_DOWN; sym++)
+        symbol[baudot_codes[sym]] = sym;
+
+    pos = ITA2_HEADER_SIZE;
+    for (n = 0; n < codes; n++) {
+        if (nbits < 5) {
+            bits |= map[pos++] << nbits;
+            nbits += 8;
+        }
+        sym = symbol[bits & 0x1f];
+        bits >>= 5;
+        nbits -= 5;
+        encode_to_baudot(ctx, sym);
+
+        /* Echo as a receiver would print it */
+        if (sym == CHAR_SHIFT_UP)
+            shift = SHIFT_FIGS;
+        else if (sym == CHAR_SHIFT_DOWN)
+            shift = SHIFT_LTRS;
+        else if (sym == CHAR_LF) {
+            fputs("\r\n", ctx->tty);
+            ctx->column = 0;
+        }
+        else if (sym == CHAR_CR)
+            ctx->column = 0;
+        else if ((c = baudot_echo[shift][sym]) != 0) {
+            putc(c, ctx->tty);
+            ctx->column++;
+        }
+    }
+    fflush(ctx->tty);
+    ctx->shift = shift;
+    munmap(map, st.st_size);
+}
+
+/*
+ * Send the whole of a file, "-" for stdin. Regular files are mapped
+ * and handed to the encoder in place; anything else is read in large
+ * blocks. Lines are never split and a last line without a newline is
+ * still sent.
+ */
+void print_file(rtty_conf *ctx, char *name)
+{
+    struct stat st;
+    char *text;
+    ssize_t n;
+    int fd;
+
+    if (!strcmp(name, "-"))
+        fd = 0;
+    else
+        fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text != MAP_FAILED) {
+            madvise(text, st.st_size, MADV_SEQUENTIAL);
+            send_text(ctx, text, st.st_size);
+            munmap(text, st.st_size);
+            if (fd)
+                close(fd);
+            return;
+        }
+    }
+
+    text = (char *) malloc(READ_SIZE);
+    if (!text) {
+        perror("malloc");
+        if (fd)
+            close(fd);
+        return;
+    }
+    while ((n = read(fd, text, READ_SIZE)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            break;
+        }
+        print_text(ctx, text, n);
+    }
+    
+    if (fd)
+        close(fd);
+    free(text);
+}
+
+
+void print_line(rtty_conf *ctx, char *line)
+{
+    if (!line) return;
+
+    print_text(ctx, line, strlen(line));
+}
+
+
+/*
+ * Send the printable characters of text, echoing them. The text is
+ * encoded a column's worth at a time, breaking at the right margin.
+ */
+void print_text(rtty_conf *ctx, const char *text, size_t size)
+{
+    const char *end = text + size;
+    const baudot_entry *e;
+    char line[COLUMN_MAX];
+    char echo[2 * COLUMN_MAX];
+    char baudot[3 * COLUMN_MAX];
+    int len;
+    int elen;
+    int n;
+    int i;
+
+    while (text < end) {
+        len = 0;
+        elen = 0;
+        for (; text < end && len < COLUMN_MAX && ctx->column < COLUMN_MAX;
+             text++) {
+            e = &baudot_table[(unsigned char) *text];
+            if (!(e->flags & BAUDOT_PRINT))
+                continue;
+            line[len++] = *text;
+            if (e->flags & BAUDOT_EOL) {
+                ctx->column = 0;
+                echo[elen++] = '\r';
+                echo[elen++] = '\n';
+            }
+            else {
+                ctx->column++;
+                echo[elen++] = e->echo;
+            }
+        }
+
+        n = baudot_encode(line, len, baudot, &ctx->shift, ctx->usos);
+        for (i = 0; i < n; i++) {
+            encode_to_baudot(ctx, baudot[i]);
+        }
+        fwrite(echo, 1, elen, ctx->tty);
+        fflush(ctx->tty);
+
+        if (ctx->column >= COLUMN_MAX) {
+            encode_to_baudot(ctx, CHAR_CR);
+            encode_to_baudot(ctx, CHAR_LF);
+            encode_to_baudot(ctx, CHAR_CR);
+            fputs("\r\n", ctx->tty);
+            ctx->column = 0;
+        }
+    }
+}
+
+
+void initialize_tty(rtty_conf *ctx)
+{
+    encode_to_baudot(ctx, CHAR_NULL);
+    encode_to_baudot(ctx, CHAR_NULL);
+    encode_to_baudot(ctx, CHAR_SHIFT_DOWN);
+    encode_to_baudot(ctx, CHAR_CR);
+    encode_to_baudot(ctx, CHAR_LF);
+    ctx->shift = SHIFT_LTRS;
+}
+
+
+void pause_print(rtty_conf *ctx, int count)
+{
+    int i;
+    for (i=0; i<count; i++) {
+        encode_to_baudot(ctx, CHAR_CLOSED);
+    }
+}
+
+
+void print_char(rtty_conf *ctx, char c)
+{
+    const baudot_entry *e = &baudot_table[(unsigned char) c];
+    char baudot[3];
+    char *bp;
+    int cnt;
+
+    cnt = baudot_encode(&c, 1, baudot, &ctx->shift, ctx->usos);
+    bp = baudot;
+    while (cnt > 0) {
+        encode_to_baudot(ctx, *bp);
+        bp++;
+        cnt--;
+    }
+    if (e->flags & BAUDOT_PRINT)
+    {
+        ctx->column++;
+        if (e->flags & BAUDOT_EOL)
+        {
+            ctx->column = 0;
+            fputs("\r\n", ctx->tty);
+        }
+        else
+        {
+            putc(e->echo, ctx->tty);
+        }
+        fflush(ctx->tty);
+    }
+
+    if (ctx->column >= COLUMN_MAX) {
+        encode_to_baudot(ctx, CHAR_CR);
+        encode_to_baudot(ctx, CHAR_LF);
+        encode_to_baudot(ctx, CHAR_CR);
+        fputs("\r\n", ctx->tty);
+        ctx->column = 0;
+    }
+}
+
+
+static void baudot_set(int c, int sym, int need)
+{
+    baudot_table[c].sym[0] = sym;
+    baudot_table[c].len = 1;
+    baudot_table[c].need = need;
+}
+
+
+void baudot_table_init(void)
+{
+    static const char figs[] = "-?:$\a'`().,;/\"";
+    static const char figs_sym[] = {
+        CHAR_DASH, CHAR_QUESTION, CHAR_COLON, CHAR_DOLLAR, CHAR_BELL,
+        CHAR_APOSTROPHE, CHAR_APOSTROPHE, CHAR_LPHAREN, CHAR_RPHAREN,
+        CHAR_PERIOD, CHAR_COMMA, CHAR_SEMICOLON, CHAR_SOLIDUS, CHAR_QUOTE
+    };
+    static const char digit_sym[] = {
+        CHAR_0, CHAR_1, CHAR_2, CHAR_3, CHAR_4,
+        CHAR_5, CHAR_6, CHAR_7, CHAR_8, CHAR_9
+    };
+    baudot_entry *e;
+    int c;
+    int i;
+
+    for (c = 0; c < 256; c++) {
+        e = &baudot_table[c];
+
+        /* There is no reasonable mapping for most characters */
+        baudot_set(c, CHAR_NULL, SHIFT_ANY);
+        if (c >= CHAR_NULL && c <= CHAR_CLOSED)
+            baudot_set(c, c, SHIFT_ANY);
+        else if (isdigit(c))
+            baudot_set(c, digit_sym[c - '0'], SHIFT_FIGS);
+        else if (isalpha(c))
+            baudot_set(c, toupper(c) - 'A', SHIFT_LTRS);
+
+        e->flags = 0;
+        e->echo = toupper(c);
+        if (isspace(c) || isalnum(c) || ispunct(c))
+            e->flags |= BAUDOT_PRINT;
+        if (c == '\n' || c == '\r')
+            e->flags |= BAUDOT_EOL;
+    }
+
+    for (i = 0; figs[i]; i++) {
+        baudot_set((unsigned char) figs[i], figs_sym[i], SHIFT_FIGS);
+    }
+    baudot_set(' ', CHAR_SPACE, SHIFT_ANY);
+    baudot_table[' '].flags |= BAUDOT_SPACE;
+    baudot_set('\n', CHAR_CR, SHIFT_ANY);
+    baudot_table['\n'].sym[1] = CHAR_LF;
+    baudot_table['\n'].len = 2;
+
+    for (c = 255; c >= 0; c--) {
+        e = &baudot_table[c];
+        if (e->need == SHIFT_ANY || !(e->flags & BAUDOT_PRINT))
+            continue;
+        baudot_echo[e->need][(int) e->sym[0]] = e->echo;
+    }
+    baudot_echo[SHIFT_LTRS][CHAR_SPACE] = ' ';
+    baudot_echo[SHIFT_FIGS][CHAR_SPACE] = ' ';
+}
+
+
+/*
+ * Encode len characters of text into Baudot symbols, shifting only
+ * in front of a character whose case differs from the line's. ITA2
+ * has no character valid in both cases other than the shift-neutral
+ * ones, so this is the fewest shifts possible. *shift carries the
+ * line state between calls. With usos a space may or may not drop a
+ * receiver back to letters, so after a space in FIGS either case is
+ * shifted into explicitly. baudot needs room for three symbols per
+ * character. Returns the number of symbols.
+ */
+int
+baudot_encode(const char *text, int len, char *baudot, int *shift, int usos)
+{
+    const baudot_entry *e;
+    char *p = baudot;
+
+    while (len-- > 0) {
+        e = &baudot_table[(unsigned char) *text++];
+        if (e->need != SHIFT_ANY && e->need != *shift) {
+            *p++ = e->need == SHIFT_FIGS ? CHAR_SHIFT_UP : CHAR_SHIFT_DOWN;
+            *shift = e->need;
+        }
+        *p++ = e->sym[0];
+        if (e->len > 1)
+            *p++ = e->sym[1];
+        if (usos && (e->flags & BAUDOT_SPACE) && *shift == SHIFT_FIGS)
+            *shift = SHIFT_UNKNOWN;
+    }
+    return p - baudot;
+}
+
+/*
+ * ITA2 codes, data bit 1 in the low bit. Start and stop elements are
+ * added at render time; Open and closed hold the line at space or
+ * mark for the whole character.
+ */
+static const unsigned char baudot_codes[BAUDOT_SYMBOLS] = {
+    0x03, /* A */
+    0x19, /* B */
+    0x0e, /* C */
+    0x09, /* D */
+    0x01, /* E / 3 */
+    0x0d, /* F */
+    0x1a, /* G */
+    0x14, /* H */
+    0x06, /* I  / 8 */
+    0x0b, /* J */
+    0x0f, /* K */
+    0x12, /* L */
+    0x1c, /* M / . */
+    0x0c, /* N */
+    0x18, /* O / 9 */
+    0x16, /* P / 0 */
+    0x17, /* Q / 1 */
+    0x0a, /* R / 4 */
+    0x05, /* S */
+    0x10, /* T / 5 */
+    0x07, /* U / 7 */
+    0x1e, /* V */
+    0x13, /* W / 2 */
+    0x1d, /* X / / */
+    0x15, /* Y / 6 */
+    0x11, /* Z */
+    0x00, /* NULL */
+    0x02, /* LF */
+    0x04, /* SPACE */
+    0x08, /* CR */
+    0x1b, /* SHIFT_UP */
+    0x1f, /* SHIFT_DOWN */
+    0x00, /* Open */
+    0x1f  /* closed */
+};
+
+
+/*
+ * Line state of element i of a character: 0 is the start element,
+ * 1-5 the data bits and 6 the stop element.
+ */
+static int baudot_element(int sym, int i)
+{
+    if (sym == CHAR_OPEN)
+        return 0;
+    if (sym == CHAR_CLOSED)
+        return 1;
+    if (i == 0)
+        return 0;
+    if (i == 6)
+        return 1;
+    return (baudot_codes[sym] >> (i - 1)) & 1;
+}
+
+
+/*
+ * The cosine of NCO phase p, 2^32 a cycle, from the quarter-wave
+ * table. The top two bits are the quadrant, the next table_bits the
+ * table step and table_bits - 1 below those interpolate to the next
+ * step. Table steps differ by under 2^31 * (pi/2) >> table_bits, so
+ * the product stays inside an int.
+ */
+static ALWAYS_INLINE int
+nco_sample(const int *tab, int table_bits, unsigned int p)
+{
+    unsigned int q = p >> 30;
+    unsigned int y = p & 0x3fffffff;
+    int idx, frac, val;
+
+    if (q & 1)
+        y = 0x40000000 - y;
+    idx = y >> (30 - table_bits);
+    frac = (y >> (31 - 2 * table_bits)) & ((1 << (table_bits - 1)) - 1);
+    val = tab[idx] + (((tab[idx + 1] - tab[idx]) * frac) >> (table_bits - 1));
+    return (q + 1) & 2 ? -val : val;
+}
+
+
+/*
+ * One step of the NCO. The phase advances by d1, and the error term
+ * carries the remainder g1 of f1 * 2^32 / speed, in units of 1/speed
+ * of a step, so the frequency is exact however long the tone runs.
+ */
+static ALWAYS_INLINE unsigned int
+tone_step(rtty_conf *ctx, unsigned int p, unsigned int d1, int g1, int *e1)
+{
+    p += d1;
+    if (*e1 < 0) {
+        *e1 += ctx->speed;
+        p += 1;
+    }
+    *e1 -= g1;
+    return p;
+}
+
+
+/*
+ * Generate count Q31 samples into out, a step at a time. The phase is
+ * kept in ctx->phase.
+ */
+static void tone_scalar(rtty_conf *ctx, unsigned int d1, int g1, int count,
+                        int *e1, int *out)
+{
+    unsigned int p = ctx->phase;
+
+    while (--count >= 0) {
+        *out++ = nco_sample(ctx->costab, ctx->table_bits, p);
+        p = tone_step(ctx, p, d1, g1, e1);
+    }
+    ctx->phase = p;
+}
+
+
+#if defined(TONE_X86) || defined(TONE_NEON)
+/*
+ * The vector generators keep one sample's phase and remainder per
+ * lane. Once e1 lies in [-g1, speed - g1), which at most one step of
+ * the NCO insures, the remainder r = e1 + g1 is in [0, speed) and w
+ * steps at once are exactly
+ *
+ *      r -= gw; if (r < 0) { r += speed; p += 1; } p += dw;
+ *
+ * where dw and gw are the quotient, mod 2^32, and remainder of
+ * w * f1 * 2^32 / speed. So the lanes produce the same samples as
+ * tone_scalar, bit for bit, whichever generator the CPU gets.
+ */
+typedef struct
+{
+    unsigned int p[TONE_LANES];
+    int r[TONE_LANES];
+    unsigned int dw;
+    int gw;
+} tone_lanes;
+
+
+/*
+ * Step the NCO until the lanes can take over, writing those samples to
+ * out, then load lanes 0 to w-1 with the next w samples' state. Returns
+ * the number of samples written.
+ */
+static int tone_lanes_init(rtty_conf *ctx, unsigned int d1, int g1,
+                           int count, int *e1, int *out, int w,
+                           tone_lanes *l)
+{
+    unsigned long long fw = (unsigned long long) w *
+                            ((unsigned long long) d1 * ctx->speed + g1);
+    unsigned int p = ctx->phase;
+    int e = *e1;
+    int n = 0;
+    int k;
+
+    while (n < count && (e < -g1 || e >= ctx->speed - g1)) {
+        out[n++] = nco_sample(ctx->costab, ctx->table_bits, p);
+        p = tone_step(ctx, p, d1, g1, &e);
+    }
+    ctx->phase = p;
+    *e1 = e;
+    for (k = 0; k < w; k++) {
+        l->p[k] = p;
+        l->r[k] = e + g1;
+        p = tone_step(ctx, p, d1, g1, &e);
+    }
+    l->dw = fw / ctx->speed;
+    l->gw = fw % ctx->speed;
+    return n;
+}
+
+
+/*
+ * Finish a run from lane 0, which holds the next sample's state.
+ */
+static void tone_lanes_done(rtty_conf *ctx, unsigned int d1, int g1,
+                            int count, int *e1, int *out, tone_lanes *l)
+{
+    ctx->phase = l->p[0];
+    *e1 = l->r[0] - g1;
+    tone_scalar(ctx, d1, g1, count, e1, out);
+}
+#endif
+
+
+#ifdef TONE_X86
+/*
+ * SSE2, in every x86-64. It has no gather and no 32-bit multiply, so
+ * the phases are stepped four at a time and each looked up alone.
+ */
+static void tone_sse2(rtty_conf *ctx, unsigned int d1, int g1, int count,
+                      int *e1, int *out)
+{
+    tone_lanes l;
+    __m128i vp, vr, dw, gw, speed, b;
+    int n;
+
+    n = tone_lanes_init(ctx, d1, g1, count, e1, out, 4, &l);
+    if (count - n < 4) {
+        tone_scalar(ctx, d1, g1, count - n, e1, out + n);
+        return;
+    }
+    vp = _mm_loadu_si128((__m128i *) l.p);
+    vr = _mm_loadu_si128((__m128i *) l.r);
+    dw = _mm_set1_epi32(l.dw);
+    gw = _mm_set1_epi32(l.gw);
+    speed = _mm_set1_epi32(ctx->speed);
+
+    for (; n + 4 <= count; n += 4) {
+        _mm_storeu_si128((__m128i *) l.p, vp);
+        out[n] = nco_sample(ctx->costab, ctx->table_bits, l.p[0]);
+        out[n + 1] = nco_sample(ctx->costab, ctx->table_bits, l.p[1]);
+        out[n + 2] = nco_sample(ctx->costab, ctx->table_bits, l.p[2]);
+        out[n + 3] = nco_sample(ctx->costab, ctx->table_bits, l.p[3]);
+
+        vr = _mm_sub_epi32(vr, gw);
+        b = _mm_srai_epi32(vr, 31);             /* -1 where it borrowed */
+        vr = _mm_add_epi32(vr, _mm_and_si128(b, speed));
+        vp = _mm_sub_epi32(_mm_add_epi32(vp, dw), b);
+    }
+    _mm_storeu_si128((__m128i *) l.p, vp);
+    _mm_storeu_si128((__m128i *) l.r, vr);
+    tone_lanes_done(ctx, d1, g1, count - n, e1, out + n, &l);
+}
+
+
+/*
+ * AVX2, eight lanes. The table is read by two gathers, of each step and
+ * the one after it, and the interpolation and quadrant done in vector,
+ * just as nco_sample does them.
+ */
+__attribute__((target("avx2")))
+static void tone_avx2(rtty_conf *ctx, unsigned int d1, int g1, int count,
+                      int *e1, int *out)
+{
+    const int *tab = ctx->costab;
+    const int bits = ctx->table_bits;
+    const __m128i idx_shift = _mm_cvtsi32_si128(30 - bits);
+    const __m128i frac_shift = _mm_cvtsi32_si128(31 - 2 * bits);
+    const __m128i interp_shift = _mm_cvtsi32_si128(bits - 1);
+    const __m256i quarter = _mm256_set1_epi32(0x40000000);
+    const __m256i low30 = _mm256_set1_epi32(0x3fffffff);
+    const __m256i frac_mask = _mm256_set1_epi32((1 << (bits - 1)) - 1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i two = _mm256_set1_epi32(2);
+    tone_lanes l;
+    __m256i vp, vr, dw, gw, speed, b;
+    __m256i q, y, idx, frac, t0, t1, val, neg;
+    int n;
+
+    n = tone_lanes_init(ctx, d1, g1, count, e1, out, 8, &l);
+    if (count - n < 8) {
+        tone_scalar(ctx, d1, g1, count - n, e1, out + n);
+        return;
+    }
+    vp = _mm256_loadu_si256((__m256i *) l.p);
+    vr = _mm256_loadu_si256((__m256i *) l.r);
+    dw = _mm256_set1_epi32(l.dw);
+    gw = _mm256_set1_epi32(l.gw);
+    speed = _mm256_set1_epi32(ctx->speed);
+
+    for (; n + 8 <= count; n += 8) {
+        q = _mm256_srli_epi32(vp, 30);
+        y = _mm256_and_si256(vp, low30);
+        b = _mm256_cmpeq_epi32(_mm256_and_si256(q, one), one);
+        y = _mm256_blendv_epi8(y, _mm256_sub_epi32(quarter, y), b);
+        idx = _mm256_srl_epi32(y, idx_shift);
+        frac = _mm256_and_si256(_mm256_srl_epi32(y, frac_shift), frac_mask);
+        t0 = _mm256_i32gather_epi32(tab, idx, 4);
+        t1 = _mm256_i32gather_epi32(tab + 1, idx, 4);
+        val = _mm256_mullo_epi32(_mm256_sub_epi32(t1, t0), frac);
+        val = _mm256_add_epi32(t0, _mm256_sra_epi32(val, interp_shift));
+        neg = _mm256_cmpeq_epi32(
+                _mm256_and_si256(_mm256_add_epi32(q, one), two), two);
+        val = _mm256_sub_epi32(_mm256_xor_si256(val, neg), neg);
+        _mm256_storeu_si256((__m256i *) (out + n), val);
+
+        vr = _mm256_sub_epi32(vr, gw);
+        b = _mm256_srai_epi32(vr, 31);
+        vr = _mm256_add_epi32(vr, _mm256_and_si256(b, speed));
+        vp = _mm256_sub_epi32(_mm256_add_epi32(vp, dw), b);
+    }
+    _mm256_storeu_si256((__m256i *) l.p, vp);
+    _mm256_storeu_si256((__m256i *) l.r, vr);
+    tone_lanes_done(ctx, d1, g1, count - n, e1, out + n, &l);
+}
+#endif
+
+
+#ifdef TONE_NEON
+/*
+ * NEON, four lanes; like SSE2 the phases are looked up one at a time.
+ */
+static void tone_neon(rtty_conf *ctx, unsigned int d1, int g1, int count,
+                      int *e1, int *out)
+{
+    tone_lanes l;
+    uint32x4_t vp, dw;
+    int32x4_t vr, gw, speed, b;
+    int n;
+
+    n = tone_lanes_init(ctx, d1, g1, count, e1, out, 4, &l);
+    if (count - n < 4) {
+        tone_scalar(ctx, d1, g1, count - n, e1, out + n);
+        return;
+    }
+    vp = vld1q_u32(l.p);
+    vr = vld1q_s32(l.r);
+    dw = vdupq_n_u32(l.dw);
+    gw = vdupq_n_s32(l.gw);
+    speed = vdupq_n_s32(ctx->speed);
+
+    for (; n + 4 <= count; n += 4) {
+        vst1q_u32(l.p, vp);
+        out[n] = nco_sample(ctx->costab, ctx->table_bits, l.p[0]);
+        out[n + 1] = nco_sample(ctx->costab, ctx->table_bits, l.p[1]);
+        out[n + 2] = nco_sample(ctx->costab, ctx->table_bits, l.p[2]);
+        out[n + 3] = nco_sample(ctx->costab, ctx->table_bits, l.p[3]);
+
+        vr = vsubq_s32(vr, gw);
+        b = vshrq_n_s32(vr, 31);
+        vr = vaddq_s32(vr, vandq_s32(b, speed));
+        vp = vsubq_u32(vaddq_u32(vp, dw), vreinterpretq_u32_s32(b));
+    }
+    vst1q_u32(l.p, vp);
+    vst1q_s32(l.r, vr);
+    tone_lanes_done(ctx, d1, g1, count - n, e1, out + n, &l);
+}
+#endif
+
+
+/*
+ * Choose the widest tone generator this CPU runs, unless --no-simd.
+ */
+void tone_select(rtty_conf *ctx)
+{
+    ctx->tone = tone_scalar;
+    ctx->tone_name = "scalar";
+    if (ctx->no_simd)
+        return;
+#if defined(TONE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ctx->tone = tone_avx2;
+        ctx->tone_name = "avx2";
+    }
+    else {
+        ctx->tone = tone_sse2;
+        ctx->tone_name = "sse2";
+    }
+#elif defined(TONE_NEON)
+    ctx->tone = tone_neon;
+    ctx->tone_name = "neon";
+#endif
+}
+
+
+/*
+ * Store count Q31 samples into dst in sample format fmt, returning the
+ * number of bytes written. Always inlined with fmt a constant, so each
+ * caller has its own loop with the store fixed and no format test per
+ * sample. Float samples are stored in host order, taken to be little
+ * endian.
+ */
+static ALWAYS_INLINE int
+store_kernel(const int *vals, int count, unsigned char *dst,
+             const snd_pcm_format_t fmt)
+{
+    unsigned char *p = dst;
+    int val;
+    float f;
+    int k;
+
+    for (k = 0; k < count; k++) {
+        val = vals[k];
+
+        switch (fmt) {
+          case SND_PCM_FORMAT_U8:
+            *p++ = 128 + (val >> 24);
+            break;
+          case SND_PCM_FORMAT_S16_LE:
+            *p++ = (val>>16) & 0xff;
+            *p++ = (val>>24) & 0xff;
+            break;
+          case SND_PCM_FORMAT_S24_3LE:
+            *p++ = (val>>8) & 0xff;
+            *p++ = (val>>16) & 0xff;
+            *p++ = (val>>24) & 0xff;
+            break;
+          case SND_PCM_FORMAT_S32_LE:
+            *p++ = val & 0xff;
+            *p++ = (val>>8) & 0xff;
+            *p++ = (val>>16) & 0xff;
+            *p++ = (val>>24) & 0xff;
+            break;
+          case SND_PCM_FORMAT_FLOAT_LE:
+            f = val * (1.0f / 2147483648.0f);
+            memcpy(p, &f, sizeof(f));
+            p += sizeof(f);
+            break;
+          default:
+            break;
+        }
+    }
+    return p - dst;
+}
+
+
+/*
+ * Synthesize count samples of frequency f1 into dst in sample format
+ * fmt, returning the number of bytes written. The NCO phase is kept
+ * in ctx->phase, to insure that the two tone signals will remain in
+ * phase when switching between frequencies. Samples come from
+ * ctx->tone a block at a time.
+ */
+static ALWAYS_INLINE int
+render_kernel(rtty_conf *ctx, int f1, int count, int *e1, unsigned char *dst,
+              const snd_pcm_format_t fmt)
+{
+    int vals[TONE_BLOCK];
+    unsigned char *p = dst;
+    unsigned int d1;
+    int g1;
+    int n;
+
+    d1 = ((unsigned long long) f1 << 32) / ctx->speed;
+    g1 = ((unsigned long long) f1 << 32) % ctx->speed;
+
+    for (; count > 0; count -= n) {
+        n = count < TONE_BLOCK ? count : TONE_BLOCK;
+        ctx->tone(ctx, d1, g1, n, e1, vals);
+        p += store_kernel(vals, n, p, fmt);
+    }
+    return p - dst;
+}
+
+
+static int render_u8(rtty_conf *ctx, int f1, int count, int *e1,
+                     unsigned char *dst)
+{
+    return render_kernel(ctx, f1, count, e1, dst, SND_PCM_FORMAT_U8);
+}
+
+
+static int render_s16(rtty_conf *ctx, int f1, int count, int *e1,
+                      unsigned char *dst)
+{
+    return render_kernel(ctx, f1, count, e1, dst, SND_PCM_FORMAT_S16_LE);
+}
+
+
+static int render_s24(rtty_conf *ctx, int f1, int count, int *e1,
+                      unsigned char *dst)
+{
+    return render_kernel(ctx, f1, count, e1, dst, SND_PCM_FORMAT_S24_3LE);
+}
+
+
+static int render_s32(rtty_conf *ctx, int f1, int count, int *e1,
+                      unsigned char *dst)
+{
+    return render_kernel(ctx, f1, count, e1, dst, SND_PCM_FORMAT_S32_LE);
+}
+
+
+static int render_float(rtty_conf *ctx, int f1, int count, int *e1,
+                        unsigned char *dst)
+{
+    return render_kernel(ctx, f1, count, e1, dst, SND_PCM_FORMAT_FLOAT_LE);
+}
+
+
+static int store_u8(const int *vals, int count, unsigned char *dst)
+{
+    return store_kernel(vals, count, dst, SND_PCM_FORMAT_U8);
+}
+
+
+static int store_s16(const int *vals, int count, unsigned char *dst)
+{
+    return store_kernel(vals, count, dst, SND_PCM_FORMAT_S16_LE);
+}
+
+
+static int store_s24(const int *vals, int count, unsigned char *dst)
+{
+    return store_kernel(vals, count, dst, SND_PCM_FORMAT_S24_3LE);
+}
+
+
+static int store_s32(const int *vals, int count, unsigned char *dst)
+{
+    return store_kernel(vals, count, dst, SND_PCM_FORMAT_S32_LE);
+}
+
+
+static int store_float(const int *vals, int count, unsigned char *dst)
+{
+    return store_kernel(vals, count, dst, SND_PCM_FORMAT_FLOAT_LE);
+}
+
+
+/*
+ * Choose the kernel and store for ctx->format, once the format is
+ * settled.
+ */
+void render_select(rtty_conf *ctx)
+{
+    switch (ctx->format) {
+      case SND_PCM_FORMAT_U8:
+        ctx->kernel = render_u8;
+        ctx->store = store_u8;
+        break;
+      case SND_PCM_FORMAT_S24_3LE:
+        ctx->kernel = render_s24;
+        ctx->store = store_s24;
+        break;
+      case SND_PCM_FORMAT_S32_LE:
+        ctx->kernel = render_s32;
+        ctx->store = store_s32;
+        break;
+      case SND_PCM_FORMAT_FLOAT_LE:
+        ctx->kernel = render_float;
+        ctx->store = store_float;
+        break;
+      default:
+        ctx->kernel = render_s16;
+        ctx->store = store_s16;
+        break;
+    }
+}
+
+
+int
+render_tone(rtty_conf *ctx, int f1, int count, int *e1, unsigned char *dst)
+{
+    return ctx->kernel(ctx, f1, count, e1, dst);
+}
+
+
+/*
+ * Frames for a duration in hundredths of a bit. The remainder is
+ * carried in ctx->bit_err, so successive durations add up to the exact
+ * baud rate however long the transmission runs.
+ */
+int bit_frames(rtty_conf *ctx, int hundredths)
+{
+    long total = (long) ctx->speed * hundredths + ctx->bit_err;
+
+    ctx->bit_err = total % ctx->baud;
+    return total / ctx->baud;
+}
+
+
+/*
+ * Symbol cache. Each Baudot character is rendered once per entry
+ * phase bucket for the active modulation parameters, and afterwards
+ * sent as a copy of the cached frame. The entry phase is rounded to
+ * the nearest bucket, a step well under one sample of phase advance,
+ * and the exact exit phase is carried on to the next symbol.
+ */
+static void symcache_flush(rtty_conf *ctx)
+{
+    int i;
+
+    if (!ctx->symcache)
+        return;
+
+    if (ctx->sympool) {
+        free(ctx->sympool);
+        ctx->sympool = NULL;
+    }
+    else {
+        for (i = 0; i < BAUDOT_SYMBOLS * SYMCACHE_PHASES; i++) {
+            free(ctx->symcache[i].pcm);
+        }
+    }
+    free(ctx->symcache);
+    ctx->symcache = NULL;
+}
+
+
+static void symcache_init(rtty_conf *ctx)
+{
+    symcache_flush(ctx);
+
+    ctx->symkey.freq_low = ctx->freq_low;
+    ctx->symkey.freq_high = ctx->freq_high;
+    ctx->symkey.speed = ctx->speed;
+    ctx->symkey.baud = ctx->baud;
+    ctx->symkey.stop_len = ctx->stop_len;
+    ctx->symkey.format = ctx->format;
+    ctx->sym_frames = (long) ctx->speed * (DATA_LEN + ctx->stop_len) /
+                      ctx->baud;
+    ctx->sym_bytes = (ctx->sym_frames + 1) * ctx->frame_size;
+
+    ctx->symcache = (sym_frame *) calloc(BAUDOT_SYMBOLS * SYMCACHE_PHASES,
+                                         sizeof(sym_frame));
+    if (ctx->symcache == NULL) {
+        perror("calloc symcache");
+        exit(1);
+    }
+}
+
+
+/*
+ * --realtime: allocate and fault in every frame of a fresh cache, so
+ * that none is allocated while sending. Too large a pool is refused,
+ * and without one frames are allocated as they are first needed.
+ */
+static int symcache_pool(rtty_conf *ctx)
+{
+    size_t size = (size_t) BAUDOT_SYMBOLS * SYMCACHE_PHASES * ctx->sym_bytes;
+
+    if (size > SYMPOOL_MAX) {
+        fprintf(stderr, "Symbol pool of %lu MB is over %d MB, not "
+                "preallocated\n", (unsigned long) (size >> 20),
+                SYMPOOL_MAX >> 20);
+        return -1;
+    }
+    ctx->sympool = (unsigned char *) malloc(size);
+    if (ctx->sympool == NULL) {
+        perror("malloc sympool");
+        return -1;
+    }
+    memset(ctx->sympool, 0, size);
+    return 0;
+}
+
+
+static int symcache_valid(rtty_conf *ctx)
+{
+    return ctx->symcache &&
+           ctx->symkey.freq_low == ctx->freq_low &&
+           ctx->symkey.freq_high == ctx->freq_high &&
+           ctx->symkey.speed == ctx->speed &&
+           ctx->symkey.baud == ctx->baud &&
+           ctx->symkey.stop_len == ctx->stop_len &&
+           ctx->symkey.format == ctx->format;
+}
+
+
+static sym_frame *symcache_lookup(rtty_conf *ctx, int sym)
+{
+    sym_frame *frame;
+    unsigned char *dst;
+    int bucket;
+    int time;
+    long err;
+    int e1;
+    int i;
+
+    if (!symcache_valid(ctx))
+        symcache_init(ctx);
+
+    bucket = ((unsigned long long) ctx->phase * SYMCACHE_PHASES +
+              (1ULL << 31)) >> 32;
+    bucket %= SYMCACHE_PHASES;
+    frame = &ctx->symcache[sym * SYMCACHE_PHASES + bucket];
+    if (frame->pcm)
+        return frame;
+
+    if (ctx->sympool)
+        frame->pcm = ctx->sympool +
+                     (size_t) (frame - ctx->symcache) * ctx->sym_bytes;
+    else
+        frame->pcm = (unsigned char *) malloc(ctx->sym_bytes);
+    if (frame->pcm == NULL) {
+        perror("malloc symbol frame");
+        exit(1);
+    }
+
+    /*
+     * Bit edges follow a bit clock of their own starting from zero, so
+     * the frame is the same whatever the running remainder; the stop
+     * element takes up the rest of the short length, plus one sample.
+     */
+    ctx->phase = ((unsigned long long) bucket << 32) / SYMCACHE_PHASES;
+    dst = frame->pcm;
+    err = 0;
+    for (i = 0; i < 6; i++) {
+        err += (long) ctx->speed * 100;
+        time = err / ctx->baud;
+        err -= (long) time * ctx->baud;
+        e1 = ctx->speed/2;
+        dst += render_tone(ctx, baudot_element(sym, i) ? ctx->freq_high :
+                                                         ctx->freq_low,
+                           time, &e1, dst);
+    }
+    time = ctx->sym_frames - (dst - frame->pcm) / ctx->frame_size;
+    e1 = ctx->speed/2;
+    dst += render_tone(ctx, baudot_element(sym, 6) ? ctx->freq_high :
+                                                     ctx->freq_low,
+                       time, &e1, dst);
+    frame->exit_phase[0] = ctx->phase;
+    render_tone(ctx, baudot_element(sym, 6) ? ctx->freq_high : ctx->freq_low,
+                1, &e1, dst);
+    frame->exit_phase[1] = ctx->phase;
+    return frame;
+}
+
+
+/*
+ * The output buffer is handed to the sink once it holds ctx->frames
+ * whole frames, ctx->bufsize bytes.
+ */
+static int pcm_limit(rtty_conf *ctx)
+{
+    return ctx->bufsize;
+}
+
+
+/*
+ * The render loop wakes when a blocking write returns, or when a sink
+ * that owns its buffer hands out the next area. The time from then to
+ * the next write is the wakeup-to-write latency.
+ */
+static void stats_wake(rtty_conf *ctx)
+{
+    clock_gettime(CLOCK_MONOTONIC, &ctx->stats->wake);
+    ctx->stats->awake = 1;
+}
+
+
+static void stats_write(rtty_conf *ctx)
+{
+    rtty_stats *st = ctx->stats;
+    struct timespec now;
+    snd_pcm_sframes_t avail;
+    long us;
+
+    if (st->awake) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        us = (now.tv_sec - st->wake.tv_sec) * 1000000 +
+             (now.tv_nsec - st->wake.tv_nsec) / 1000;
+        if (us > st->lat_max)
+            st->lat_max = us;
+        us /= STATS_LAT_US;
+        st->lat[us < STATS_LAT_MAX ? us : STATS_LAT_MAX]++;
+        st->lat_count++;
+        st->awake = 0;
+    }
+    if (ctx->pcm) {
+        avail = snd_pcm_avail_update(ctx->pcm);
+        if (avail < 0 || avail > ctx->buffer_size)
+            avail = ctx->buffer_size;
+        st->fill[100 - avail * 100 / ctx->buffer_size]++;
+        st->fill_count++;
+    }
+}
+
+
+/* The bucket holding the p'th fraction of count samples */
+static int stats_percentile(const unsigned int *hist, int buckets,
+                            unsigned long count, double p)
+{
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < buckets; i++) {
+        sum += hist[i];
+        if (sum > p * count)
+            break;
+    }
+    return i < buckets ? i : buckets - 1;
+}
+
+
+void stats_report(rtty_conf *ctx)
+{
+    rtty_stats *st = ctx->stats;
+    static const double lat_p[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const double fill_p[] = { 0.001, 0.01, 0.1, 0.5 };
+    int i;
+
+    if (device_count > 1)
+        fprintf(stderr, "stats: %s\n", ctx->output);
+
+    if (st->lat_count) {
+        fprintf(stderr, "stats: %lu writes, wakeup-to-write us:",
+                st->lat_count);
+        for (i = 0; i < 4; i++) {
+            fprintf(stderr, " p%g %d", lat_p[i] * 100,
+                    STATS_LAT_US * stats_percentile(st->lat,
+                        STATS_LAT_MAX + 1, st->lat_count, lat_p[i]));
+        }
+        fprintf(stderr, " max %ld\n", st->lat_max);
+    }
+    if (st->fill_count) {
+        fprintf(stderr, "stats: ring fill %% of %lu frames: min %d",
+                (unsigned long) ctx->buffer_size,
+                stats_percentile(st->fill, 101, st->fill_count, 0));
+        for (i = 0; i < 4; i++) {
+            fprintf(stderr, " p%g %d", fill_p[i] * 100,
+                    stats_percentile(st->fill, 101, st->fill_count,
+                                     fill_p[i]));
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+
+/* Touch the stack the audio path will use, so it is already mapped */
+static void prefault_stack(void)
+{
+    volatile unsigned char stack[64 * 1024];
+    int i;
+
+    for (i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+
+/*
+ * --realtime: the thread feeding the sink runs SCHED_FIFO with all
+ * memory locked. Its buffers, the symbol cache and costab are faulted
+ * in before the lock is taken; a symbol pool too large to lock is
+ * dropped, and symbol frames are then allocated as first sent. Else,
+ * with the prime period sized for --latency backoff and the macros
+ * rendered by msgcache_macros(), the audio path neither pages nor
+ * allocates. Only with --threads, though: without them input is
+ * handled on this thread too, and a message not yet in the message
+ * cache is rendered, and allocates, here.
+ */
+void realtime_setup(rtty_conf *ctx)
+{
+    struct sched_param sp;
+    volatile int sum = 0;
+    int err;
+    int i;
+
+    prefault_stack();
+    symcache_init(ctx);
+    symcache_pool(ctx);
+    if (ctx->buf && ctx->sink->begin == NULL)
+        memset(ctx->buf, 0, ctx->bufcap);
+    for (i = 0; i < (1 << ctx->table_bits) + 2; i++)
+        sum += ctx->costab[i];
+
+    /* If the pool is more than may be locked, lock the rest without it */
+    err = mlockall(MCL_CURRENT | MCL_FUTURE);
+    if (err < 0 && ctx->sympool) {
+        fprintf(stderr, "mlockall: %s, symbol pool dropped\n",
+                strerror(errno));
+        symcache_init(ctx);
+        err = mlockall(MCL_CURRENT | MCL_FUTURE);
+    }
+    if (err < 0)
+        perror("mlockall");
+
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = ctx->realtime;
+    err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+    if (err)
+        fprintf(stderr, "SCHED_FIFO priority %d: %s\n", ctx->realtime,
+                strerror(err));
+}
+
+
+/*
+ * The output buffer, for sinks that don't hand out their own. There is
+ * room for the 100 ms periods --latency may back off to.
+ */
+void pcm_alloc(rtty_conf *ctx)
+{
+    ctx->bufsize = ctx->frames * ctx->frame_size;
+
+    if (ctx->sink->begin == NULL) {
+        ctx->bufcap = ctx->bufsize;
+        if (ctx->latency_ms && ctx->bufcap < ctx->speed / 10 *
+                               ctx->write_periods * ctx->frame_size)
+            ctx->bufcap = ctx->speed / 10 * ctx->write_periods *
+                          ctx->frame_size;
+        ctx->buf = malloc(ctx->bufcap);
+        if (ctx->buf == NULL) {
+            perror("malloc buf");
+            exit(1);
+        }
+    }
+}
+
+
+/*
+ * Sinks that own their buffer are asked for the next area to render
+ * into when the previous one has been handed back.
+ */
+static void pcm_begin(rtty_conf *ctx)
+{
+    int frames;
+
+    if (ctx->bufidx == 0 && ctx->sink->begin) {
+        ctx->buf = ctx->sink->begin(ctx, &frames);
+        ctx->bufsize = frames * ctx->frame_size;
+        if (ctx->stats)
+            stats_wake(ctx);
+    }
+}
+
+
+void pcm_flush(rtty_conf *ctx)
+{
+    int frames = ctx->bufidx / ctx->frame_size;
+
+    if (ctx->stats)
+        stats_write(ctx);
+    ctx->sink->write(ctx, ctx->buf, frames);
+    ctx->write_total += frames;
+    ctx->bufidx = 0;
+    if (ctx->stats && ctx->sink->begin == NULL)
+        stats_wake(ctx);
+}
+
+
+void sink_close(rtty_conf *ctx)
+{
+    if (ctx->bufidx)
+        pcm_flush(ctx);
+    if (ctx->stats)
+        stats_report(ctx);
+    ctx->sink->close(ctx);
+}
+
+
+/*
+ * Append len bytes of rendered samples to the output buffer.
+ */
+static void pcm_write(rtty_conf *ctx, const unsigned char *data, int len)
+{
+    int n;
+
+    while (len > 0) {
+        pcm_begin(ctx);
+        n = pcm_limit(ctx) - ctx->bufidx;
+        if (n > len)
+            n = len;
+        memcpy(ctx->buf + ctx->bufidx, data, n);
+        ctx->bufidx += n;
+        data += n;
+        len -= n;
+
+        if (ctx->bufidx >= pcm_limit(ctx))
+            pcm_flush(ctx);
+    }
+}
+
+
+void
+encode_to_baudot(rtty_conf *ctx, char c)
+{
+    sym_frame *frame;
+    int i;
+    int n;
+
+    i = (int) c;
+    if (ctx->ita2) {
+        if (i>=0 && i<=CHAR_SHIFT_DOWN)
+            ita2_put(ctx->ita2, baudot_codes[i]);
+        return;
+    }
+    if (ctx->render) {
+        render_put(ctx, OP_SYMBOL, 0, i);
+        return;
+    }
+    if (i>=0 && i<BAUDOT_SYMBOLS) {
+        frame = symcache_lookup(ctx, i);
+        n = bit_frames(ctx, DATA_LEN + ctx->stop_len) - ctx->sym_frames;
+        pcm_write(ctx, frame->pcm, (ctx->sym_frames + n) * ctx->frame_size);
+        ctx->phase = frame->exit_phase[n];
+    }
 }
 
-void print_file(rtty_conf *ctx, char *name)
-{
-    FILE *fp;
-    char *line;
 
-    fp = fopen(name, "r");
-    if (!fp) {
-        perror("fopen");
+void
+write_freq_to_alsa(rtty_conf *ctx, int f1, int msec)
+{
+    if (msec <= 0)
         return;
-    }
-    line = (char *) malloc(1024);
-    if (!line) {
-        perror("malloc");
-        fclose(fp);
+
+    if (ctx->render) {
+        render_put(ctx, OP_TONE, f1, msec);
         return;
     }
-    fgets(line, 1022, fp);
-    while (!feof(fp)) {
-        print_line(ctx, line);
-        fgets(line, 1022, fp);
-    }
-    
-    fclose(fp);
-    free(line);
+    write_tone_frames(ctx, f1, (msec * ctx->speed) / 1000);
 }
 
 
-void print_line(rtty_conf *ctx, char *line)
+void
+write_tone_frames(rtty_conf *ctx, int f1, int time)
 {
-    char *cp;
-    if (!line) return;
+    int e1;
+    int n;
 
-    for (cp=line; *cp; cp++) {
-        if (isspace(*cp) || isalnum(*cp) || ispunct(*cp)) {
-            print_char(ctx, *cp);
-        }
+    e1 = ctx->speed/2;
+    while (time > 0) {
+        pcm_begin(ctx);
+        n = (pcm_limit(ctx) - ctx->bufidx) / ctx->frame_size;
+        if (n > time)
+            n = time;
+        ctx->bufidx += render_tone(ctx, f1, n, &e1, ctx->buf + ctx->bufidx);
+        time -= n;
+
+        if (ctx->bufidx >= pcm_limit(ctx))
+            pcm_flush(ctx);
     }
 }
 
+/*
+ * Message cache. Repeated text -- station IDs, CQ calls, macros -- is
+ * rendered once and afterwards copied straight into the output. An
+ * entry is found by an FNV-1a hash of the text and every modulation
+ * parameter, and the text itself is compared. With --cache-dir the
+ * rendered messages are kept in files, mapped when first used, so
+ * they last from one run to the next.
+ */
+static msgcache_entry msgcache[MSGCACHE_ENTRIES];
+static int msgcache_count;
+
 
-void initialize_tty(rtty_conf *ctx)
+static void msgcache_params(rtty_conf *ctx, int *params)
 {
-    encode_to_baudot(ctx, CHAR_NULL);
-    encode_to_baudot(ctx, CHAR_NULL);
-    encode_to_baudot(ctx, CHAR_SHIFT_DOWN);
-    encode_to_baudot(ctx, CHAR_CR);
-    encode_to_baudot(ctx, CHAR_LF);
+    params[0] = ctx->freq_low;
+    params[1] = ctx->freq_high;
+    params[2] = ctx->speed;
+    params[3] = ctx->baud;
+    params[4] = ctx->stop_len;
+    params[5] = ctx->format;
+    params[6] = ctx->frame_size;
+    params[7] = ctx->volume;
+    params[8] = ctx->table_bits;
+    params[9] = ctx->usos;
 }
 
 
-void pause_print(rtty_conf *ctx, int count)
+static unsigned long long fnv1a(unsigned long long hash, const void *data,
+                                size_t len)
 {
-    int i;
-    for (i=0; i<count; i++) {
-        encode_to_baudot(ctx, CHAR_CLOSED);
+    const unsigned char *p = (const unsigned char *) data;
+
+    while (len-- > 0) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
     }
+    return hash;
 }
 
 
-void print_char(rtty_conf *ctx, char c)
+static void msgcache_path(rtty_conf *ctx, unsigned long long hash,
+                          char *path, size_t len)
 {
-    char baudot[16];
-    char *bp;
-    int cnt;
-    struct timeval tv;
-    int pcm_bits = 0;
-    int sent = 0;
+    snprintf(path, len, "%s/%016llx.rtty", ctx->cache_dir, hash);
+}
+
+
+/* Map a cache file into e, if there is one for exactly this text */
+static int msgcache_load(rtty_conf *ctx, msgcache_entry *e,
+                         const char *text, size_t size)
+{
+    int params[MSGCACHE_PARAMS];
+    msgcache_hdr *hdr;
+    char path[4096];
+    struct stat st;
+    char *map;
+    int fd;
+
+    msgcache_path(ctx, e->hash, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(msgcache_hdr)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
 
-    while (!sent)
+    hdr = (msgcache_hdr *) map;
+    msgcache_params(ctx, params);
+    if (memcmp(hdr->magic, MSGCACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->hash != e->hash ||
+        memcmp(hdr->params, params, sizeof(params)) ||
+        hdr->text_len != size ||
+        sizeof(msgcache_hdr) + hdr->text_len + hdr->echo_len +
+            hdr->pcm_bytes != st.st_size ||
+        memcmp(map + sizeof(msgcache_hdr), text, size))
     {
-        /* 
-         * Feedback loop to prevent PCM underrun when no data is
-         * entered from the keyboard. Send 150ms worth of blank
-         * data. This is slightly more than the select() timeout,
-         * so an underrun should never happen.
-         */
-        pcm_bits = snd_pcm_avail_update(ctx->pcm);
-        if (1 || pcm_bits > (ctx->PCM_MAX - ctx->speed/4))
-        {
-            cnt = ascii_2_baudot(c, baudot, &ctx->shift);
-            bp = baudot;
-            while (cnt > 0) {
-                encode_to_baudot(ctx, *bp);
-                bp++;
-                cnt--;
-            }
-            sent = 1;
-            if (isspace(c) || isalnum(c) || ispunct(c))
-            {
-                ctx->column++;
-                if (c == '\n' || c == '\r')
-                {
-                    ctx->column = 0;
-                    printf("\r\n");
-                }
-                else
-                {
-                    putchar((char) toupper((int) c));
-                }
-                fflush(stdout);
-            }
+        munmap(map, st.st_size);
+        return 0;
+    }
 
-            if (ctx->column >= COLUMN_MAX) {
-                encode_to_baudot(ctx, CHAR_CR);
-                encode_to_baudot(ctx, CHAR_LF);
-                encode_to_baudot(ctx, CHAR_CR);
-                printf("\r\n");
-                ctx->column = 0;
-            }
-        }
-        else
-        {
-printf("timeout!!!!\n");
-            tv.tv_sec = 0;
-            tv.tv_usec = 100000; /* Timeout to send blank data every 100ms */
-            select(0, NULL, NULL, NULL, &tv);
-        }
+    e->map = map;
+    e->map_len = st.st_size;
+    e->text = map + sizeof(msgcache_hdr);
+    e->text_len = hdr->text_len;
+    e->echo = e->text + e->text_len;
+    e->echo_len = hdr->echo_len;
+    e->pcm = (unsigned char *) e->echo + e->echo_len;
+    e->pcm_bytes = hdr->pcm_bytes;
+    e->exit_phase = hdr->exit_phase;
+    e->shift = hdr->shift;
+    e->column = hdr->column;
+    return 1;
+}
+
+
+/* Write e to its cache file, through a temporary name */
+static void msgcache_store(rtty_conf *ctx, msgcache_entry *e)
+{
+    msgcache_hdr hdr;
+    char path[4096];
+    char tmp[4096 + 16];
+    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MSGCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.hash = e->hash;
+    msgcache_params(ctx, hdr.params);
+    hdr.text_len = e->text_len;
+    hdr.echo_len = e->echo_len;
+    hdr.pcm_bytes = e->pcm_bytes;
+    hdr.exit_phase = e->exit_phase;
+    hdr.shift = e->shift;
+    hdr.column = e->column;
+
+    msgcache_path(ctx, e->hash, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tmp);
+        return;
+    }
+    write_all(fd, (unsigned char *) &hdr, sizeof(hdr));
+    write_all(fd, (unsigned char *) e->text, e->text_len);
+    write_all(fd, (unsigned char *) e->echo, e->echo_len);
+    write_all(fd, e->pcm, e->pcm_bytes);
+    close(fd);
+    if (rename(tmp, path) < 0) {
+        perror(path);
+        unlink(tmp);
     }
 }
 
 
-int
-ascii_2_baudot(char c, char *baudot, int *shift)
+/*
+ * Render text into e through a copy of ctx whose sink collects the
+ * samples and whose echo goes to memory.
+ */
+static void msgcache_render(rtty_conf *ctx, msgcache_entry *e,
+                            const char *text, size_t size)
 {
-    int i;
-    char *p = baudot;
+    rtty_conf tmp = *ctx;
 
-    /* Convert punction characters first */
-    switch (c) {
-      case '-':
-        *p++ = CHAR_DASH;
-        break;
-      case '?':
-        *p++ = CHAR_QUESTION;
-        break;
-      case ':':
-        *p++ = CHAR_COLON;
-        break;
-      case '$':
-        *p++ = CHAR_DOLLAR;
-        break;
-      case 7:
-        *p++ = CHAR_BELL;
-        break;
-      case '\'':
-      case '`':
-        *p++ = CHAR_APOSTROPHE;
-        break;
-      case '(':
-        *p++ = CHAR_LPHAREN;
-        break;
-      case ')':
-        *p++ = CHAR_RPHAREN;
-        break;
-      case '.':
-        *p++ = CHAR_PERIOD;
-        break;
-      case ',':
-        *p++ = CHAR_COMMA;
-        break;
-      case ';':
-        *p++ = CHAR_SEMICOLON;
-        break;
-      case '/':
-        *p++ = CHAR_SOLIDUS;
-        break;
-      case '"':
-        *p++ = CHAR_QUOTE;
-        break;
+    tmp.sink = &capture_sink;
+    tmp.render = NULL;
+    tmp.pcm = NULL;
+    tmp.stats = NULL;
+    tmp.realtime = 0;
+    tmp.mem = NULL;
+    tmp.mem_size = 0;
+    tmp.out_bytes = 0;
+    tmp.bufidx = 0;
+    tmp.bufsize = FILE_FRAMES * ctx->frame_size;
+    tmp.buf = (unsigned char *) malloc(tmp.bufsize);
+    tmp.phase = 0;
+    tmp.bit_err = 0;
+    tmp.shift = SHIFT_UNKNOWN;
+    tmp.column = 0;
+    tmp.tty = open_memstream(&e->echo, &e->echo_len);
+    if (tmp.buf == NULL || tmp.tty == NULL) {
+        perror("msgcache");
+        exit(1);
+    }
+    /* Share the symbol cache only while it is current */
+    if (!symcache_valid(ctx)) {
+        tmp.symcache = NULL;
+        tmp.sympool = NULL;
     }
 
-    /* p has advanced one byte if we have found a character to convert */
+    print_text(&tmp, text, size);
+    if (tmp.bufidx)
+        pcm_flush(&tmp);
 
-    if (p != baudot) {
-        /*
-         * Prefix the converted character with shift up if not 
-         * already shifted
-         */
-        if (!*shift) {
-            p[0] = p[-1];
-            p[-1] = CHAR_SHIFT_UP;
-            p++;
-            *shift = 1;
-        }
+    fclose(tmp.tty);
+    free(tmp.buf);
+    if (tmp.symcache != ctx->symcache)
+        symcache_flush(&tmp);
+
+    e->text = (char *) malloc(size);
+    if (e->text == NULL) {
+        perror("malloc");
+        exit(1);
     }
-    else {
+    memcpy(e->text, text, size);
+    e->text_len = size;
+    e->pcm = tmp.mem;
+    e->pcm_bytes = tmp.out_bytes;
+    e->exit_phase = tmp.phase;
+    e->shift = tmp.shift;
+    e->column = tmp.column;
+    e->map = NULL;
+}
 
-        /* The current character has not been mapped */
 
-        i = (int) c;
-        if (c == ' ') {
-            *p++ = CHAR_SPACE;
-        }
-        else if (c == '\n') {
-            *p++ = CHAR_CR;
-            *p++ = CHAR_LF;
-        }
-        else if (isdigit(c)) {
-            if (!*shift) {
-                *shift = 1;
-                *p++ = CHAR_SHIFT_UP;
-            }
-            i = (int) (c - '0');
-            switch(i) {
-              case 0:
-                *p++ = CHAR_0;
-                break;
-              case 1:
-                *p++ = CHAR_1;
-                break;
-              case 2:
-                *p++ = CHAR_2;
-                break;
-              case 3:
-                *p++ = CHAR_3;
-                break;
-              case 4:
-                *p++ = CHAR_4;
-                break;
-              case 5:
-                *p++ = CHAR_5;
-                break;
-              case 6:
-                *p++ = CHAR_6;
-                break;
-              case 7:
-                *p++ = CHAR_7;
-                break;
-              case 8:
-                *p++ = CHAR_8;
-                break;
-              case 9:
-                *p++ = CHAR_9;
-                break;
-            }
-        }
-        else if (isalpha(c)) {
-            if (*shift) {
-                *shift = 0;
-                *p++ = CHAR_SHIFT_DOWN;
-            }
-            *p++ = (char) (toupper(c) - 'A');
-        }
-        else if (i>=CHAR_NULL && i<=CHAR_CLOSED) {
-           *p++ = i;
+/*
+ * Play a cached message. Mark is padded on first until the carrier
+ * phase comes round to where the message was rendered from, so the
+ * join to live traffic is as smooth as one between two symbols.
+ */
+void msgcache_play(rtty_conf *ctx, int index)
+{
+    msgcache_entry *e = &msgcache[index];
+    unsigned int step = ((unsigned long long) ctx->freq_high << 32) /
+                        ctx->speed;
+    unsigned int pos = ctx->phase;
+    unsigned int best = pos < 0x80000000u ? pos : 0u - pos;
+    unsigned int dist;
+    int pad = 0;
+    int n;
+
+    for (n = 1; n <= ctx->speed / ctx->freq_high + 1; n++) {
+        pos += step;
+        dist = pos < 0x80000000u ? pos : 0u - pos;
+        if (dist < best) {
+            best = dist;
+            pad = n;
         }
-        else {
-            /*
-             * There is no reasonable mapping for this character
-             */
-            *p++ = CHAR_NULL;
+    }
+    write_tone_frames(ctx, ctx->freq_high, pad);
+
+    pcm_write(ctx, e->pcm, e->pcm_bytes);
+    ctx->phase = e->exit_phase;
+}
+
+
+/*
+ * The cache entry for text, loaded or rendered if this is the first
+ * time it is seen; -1 when the cache is full.
+ */
+static int msgcache_find(rtty_conf *ctx, const char *text, size_t size)
+{
+    int params[MSGCACHE_PARAMS];
+    unsigned long long hash;
+    msgcache_entry *e;
+    int i;
+
+    msgcache_params(ctx, params);
+    hash = fnv1a(0xcbf29ce484222325ULL, params, sizeof(params));
+    hash = fnv1a(hash, text, size);
+
+    for (i = 0; i < msgcache_count; i++) {
+        if (msgcache[i].hash == hash && msgcache[i].text_len == size &&
+            !memcmp(msgcache[i].text, text, size))
+            break;
+    }
+    if (i == msgcache_count) {
+        if (msgcache_count == MSGCACHE_ENTRIES)
+            return -1;
+        e = &msgcache[i];
+        msgcache_count++;
+        e->hash = hash;
+        if (!ctx->cache_dir || !msgcache_load(ctx, e, text, size)) {
+            msgcache_render(ctx, e, text, size);
+            if (ctx->cache_dir)
+                msgcache_store(ctx, e);
         }
     }
-    return p - baudot;
+    return i;
 }
 
-void
-encode_to_baudot(rtty_conf *ctx, char c)
+
+/*
+ * Send text from the message cache, rendering it first if this is the
+ * first time it is seen. It starts on a fresh line.
+ */
+void msgcache_send(rtty_conf *ctx, const char *text, size_t size)
 {
+    msgcache_entry *e;
     int i;
 
-static char baudot_bits[][8] = {
-    {0, 1, 1, 0, 0, 0, 1, 1}, /* A */
-    {0, 1, 0, 0, 1, 1, 1, 1}, /* B */
-    {0, 0, 1, 1, 1, 0, 1, 1}, /* C */
-    {0, 1, 0, 0, 1, 0, 1, 1}, /* D */
-    {0, 1, 0, 0, 0, 0, 1, 1}, /* E / 3 */
-    {0, 1, 0, 1, 1, 0, 1, 1}, /* F */
-    {0, 0, 1, 0, 1, 1, 1, 1}, /* G */
-    {0, 0, 0, 1, 0, 1, 1, 1}, /* H */
-    {0, 0, 1, 1, 0, 0, 1, 1}, /* I  / 8 */
-    {0, 1, 1, 0, 1, 0, 1, 1}, /* J */
-    {0, 1, 1, 1, 1, 0, 1, 1}, /* K */
-    {0, 0, 1, 0, 0, 1, 1, 1}, /* L */
-    {0, 0, 0, 1, 1, 1, 1, 1}, /* M / . */
-    {0, 0, 0, 1, 1, 0, 1, 1}, /* N */
-    {0, 0, 0, 0, 1, 1, 1, 1}, /* O / 9 */
-    {0, 0, 1, 1, 0, 1, 1, 1}, /* P / 0 */
-    {0, 1, 1, 1, 0, 1, 1, 1}, /* Q / 1 */
-    {0, 0, 1, 0, 1, 0, 1, 1}, /* R / 4 */
-    {0, 1, 0, 1, 0, 0, 1, 1}, /* S */
-    {0, 0, 0, 0, 0, 1, 1, 1}, /* T / 5 */
-    {0, 1, 1, 1, 0, 0, 1, 1}, /* U / 7 */
-    {0, 0, 1, 1, 1, 1, 1, 1}, /* V */
-    {0, 1, 1, 0, 0, 1, 1, 1}, /* W / 2 */
-    {0, 1, 0, 1, 1, 1, 1, 1}, /* X / / */
-    {0, 1, 0, 1, 0, 1, 1, 1}, /* Y / 6 */
-    {0, 1, 0, 0, 0, 1, 1, 1}, /* Z */
-    {0, 0, 0, 0, 0, 0, 1, 1}, /* NULL */
-    {0, 0, 1, 0, 0, 0, 1, 1}, /* LF */
-    {0, 0, 0, 1, 0, 0, 1, 1}, /* SPACE */
-    {0, 0, 0, 0, 1, 0, 1, 1}, /* CR */
-    {0, 1, 1, 0, 1, 1, 1, 1}, /* SHIFT_UP */
-    {0, 1, 1, 1, 1, 1, 1, 1}, /* SHIFT_DOWN */
-    {0, 0, 0, 0, 0, 0, 0, 0}, /* Open */
-    {1, 1, 1, 1, 1, 1, 1, 1}  /* closed */
-};
+    i = msgcache_find(ctx, text, size);
+    if (i < 0) {
+        print_text(ctx, text, size);
+        return;
+    }
+    e = &msgcache[i];
+
+    if (ctx->column)
+        print_text(ctx, "\n", 1);
+    if (ctx->render)
+        render_put(ctx, OP_CACHED, 0, i);
+    else
+        msgcache_play(ctx, i);
+    fwrite(e->echo, 1, e->echo_len, ctx->tty);
+    fflush(ctx->tty);
+    ctx->shift = e->shift;
+    ctx->column = e->column;
+}
 
 
-    i = (int) c;
-    if (i>=0 && i<(sizeof(baudot_bits)/8)) {
-       encode_bits(ctx, baudot_bits[i], 8);
+/*
+ * --realtime: render the keyboard macros up front, so that sending one
+ * allocates nothing.
+ */
+void msgcache_macros(rtty_conf *ctx)
+{
+    int i;
+
+    for (i = 0; i < MACROS; i++) {
+        if (ctx->macro[i])
+            msgcache_find(ctx, ctx->macro[i], strlen(ctx->macro[i]));
     }
 }
 
 
-void encode_bits(rtty_conf *ctx, char *bits, int len)
+/*
+ * Whole messages, such as the command line or a mapped file, go
+ * through the message cache when --cache-dir is given.
+ */
+void send_text(rtty_conf *ctx, const char *text, size_t size)
+{
+    if (ctx->cache_dir && size <= MSGCACHE_MAX_TEXT)
+        msgcache_send(ctx, text, size);
+    else
+        print_text(ctx, text, size);
+}
+
+
+/* Command line words are sent as one line */
+void send_words(rtty_conf *ctx, int count, char **words)
 {
+    char *text;
+    size_t size = 0;
     int i;
 
-    for (i=0; i < len; i++) {
-        encode_bit(ctx, bits[i]);
+    if (count <= 0)
+        return;
+    for (i = 0; i < count; i++)
+        size += strlen(words[i]) + 1;
+    text = (char *) malloc(size);
+    if (text == NULL) {
+        perror("malloc");
+        exit(1);
     }
+    for (size = 0, i = 0; i < count; i++) {
+        strcpy(text + size, words[i]);
+        size += strlen(words[i]);
+        text[size++] = i + 1 < count ? ' ' : '\n';
+    }
+    send_text(ctx, text, size);
+    free(text);
 }
 
 
+/*
+ * Peak of a tone in Q31. With --vft-channel the channels share full
+ * scale, so that their sum cannot clip.
+ */
+static double tone_amplitude(rtty_conf *ctx)
+{
+    double amp = (ctx->volume/100.0)*COS_Q31;
+
+    if (vft_count)
+        amp /= vft_count;
+    return amp;
+}
+
 
-void
-encode_bit(rtty_conf *ctx, int c) 
+/*
+ * Open a channel's input. On a live device it is read without waiting,
+ * so that a channel with nothing to send yet idles rather than holding
+ * up the others.
+ */
+static void vft_input(rtty_conf *ctx, vft_channel *ch)
 {
-    switch(c) {
-    case 0:
-        write_freq_to_alsa(ctx, ctx->freq_low, ctx->bit_delay);
-        break;
-    case 1:
-        write_freq_to_alsa(ctx, ctx->freq_high, ctx->bit_delay);
-        break;
+    if (!strcmp(ch->input, "-"))
+        ch->fd = 0;
+    else
+        ch->fd = open(ch->input, O_RDONLY);
+    ch->text = (char *) malloc(READ_SIZE);
+    if (ch->fd < 0 || ch->text == NULL) {
+        perror(ch->input);
+        exit(1);
     }
+    ch->flags = fcntl(ch->fd, F_GETFL);
+    if (ctx->pcm)
+        fcntl(ch->fd, F_SETFL, ch->flags | O_NONBLOCK);
 }
 
 
-void
-write_freq_to_alsa(rtty_conf *ctx, int f1, int msec)
+/*
+ * Read the next of a channel's input. 1 when there is text to send,
+ * 0 when there is none yet or, with eof set, none to come.
+ */
+static int vft_read(vft_channel *ch)
 {
-    int d1, e1, g1;
-    int time;
-    int val;
-    int sts = 0;
-    int frame_size = 1;
-    /*
-     * This variable must be static, to insure that the two tone signals
-     * will remain in phase when switching between frequencies.
-     */
-    static int i1;
+    ssize_t n;
 
-    if (msec <= 0)
-        return;
+    n = read(ch->fd, ch->text, READ_SIZE);
+    if (n > 0) {
+        ch->pos = 0;
+        ch->size = n;
+        return 1;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n < 0)
+        perror(ch->input);
+    ch->eof = 1;
+    return 0;
+}
 
-    f1 *= ctx->tabsize;
-    d1 = f1 / ctx->speed;
-    g1 = f1 - d1 * ctx->speed;
-    e1 = ctx->speed/2;
+
+/*
+ * Give a channel its own modulator, a copy of ctx rendering Q31
+ * samples into memory, and start it as main() starts a transmission.
+ */
+static void vft_open(rtty_conf *ctx, vft_channel *ch, FILE *echo)
+{
+    rtty_conf *c = &ch->ctx;
+
+    vft_input(ctx, ch);
+
+    *c = *ctx;
+    c->sink = &capture_sink;
+    c->render = NULL;
+    c->pcm = NULL;
+    c->stats = NULL;
+    c->realtime = 0;
+    c->ita2 = NULL;
+    c->cache_dir = NULL;
+    c->mem = NULL;
+    c->mem_size = 0;
+    c->out_bytes = 0;
+    c->format = SND_PCM_FORMAT_S32_LE;
+    c->bits = 32;
+    c->frame_size = 4;
+    render_select(c);
+    c->bufidx = 0;
+    c->bufsize = FILE_FRAMES * c->frame_size;
+    c->buf = (unsigned char *) malloc(c->bufsize);
+    if (c->buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    c->phase = 0;
+    c->bit_err = 0;
+    c->column = 0;
+    c->freq_low = ch->freq;
+    c->freq_high = ch->freq + ctx->freq_high - ctx->freq_low;
+    c->symcache = NULL;
+    c->sympool = NULL;
+    c->tty = echo;
+
+    write_freq_to_alsa(c, c->freq_high, 500);
+    pause_print(c, 10);
+    initialize_tty(c);
+}
 
 
-    time = (msec * ctx->speed) / 1000;
-    while(--time >= 0) {
-        val = ctx->costab[i1];
+/*
+ * Render a channel until it holds at least frames frames: its next
+ * characters while it has any, mark while waiting for more input, and
+ * steady mark once it is done.
+ */
+static void vft_fill(vft_channel *ch, int frames)
+{
+    rtty_conf *c = &ch->ctx;
+    long have;
 
-        if (ctx->format == SND_PCM_FORMAT_U8) {
-            ctx->buf[ctx->bufidx++] = 128 + (val >> 8); 
-            frame_size = 1;
+    while ((have = c->out_bytes / c->frame_size) < frames) {
+        if (ch->pos < ch->size) {
+            print_text(c, ch->text + ch->pos, 1);
+            ch->pos++;
         }
-        else if (ctx->format == SND_PCM_FORMAT_S16_LE) {
-            ctx->buf[ctx->bufidx++] = val & 0xff;
-            ctx->buf[ctx->bufidx++] = (val>>8) & 0xff;
-            frame_size = 2;
+        else if (!ch->eof) {
+            if (!vft_read(ch) && !ch->eof)
+                write_tone_frames(c, c->freq_high, frames - have);
         }
-
-        i1 += d1;
-        if (e1 < 0) {
-            e1 += ctx->speed;
-            i1 += 1;
+        else if (!ch->done) {
+            initialize_tty(c);
+            pause_print(c, 10);
+            if (c->bufidx)
+                pcm_flush(c);
+            ch->done = 1;
+            ch->left = c->out_bytes / c->frame_size;
         }
-        if (i1 >= ctx->tabsize)
-            i1 -= ctx->tabsize;
+        else {
+            write_tone_frames(c, c->freq_high, frames - have);
+        }
+        if (c->bufidx)
+            pcm_flush(c);
+    }
+}
+
+
+/*
+ * Add count Q31 samples of in to sum. The tables are scaled by the
+ * number of channels, so the sum cannot overflow.
+ */
+static void vft_mix(int *sum, const int *in, int count)
+{
+    int k = 0;
+
+#if defined(TONE_X86)
+    for (; k + 4 <= count; k += 4) {
+        _mm_storeu_si128((__m128i *) (sum + k),
+                         _mm_add_epi32(_mm_loadu_si128((__m128i *) (sum + k)),
+                                       _mm_loadu_si128((__m128i *) (in + k))));
+    }
+#elif defined(TONE_NEON)
+    for (; k + 4 <= count; k += 4)
+        vst1q_s32(sum + k, vaddq_s32(vld1q_s32(sum + k), vld1q_s32(in + k)));
+#endif
+    for (; k < count; k++)
+        sum[k] += in[k];
+}
+
+
+/*
+ * --vft-channel: send every channel's input at once, each on its own
+ * tones, summed into the one stream. Mixing is a block of ctx->frames
+ * at a time and ends when the last channel has sent its closing
+ * sequence; channels that finish earlier idle on mark.
+ */
+void vft_run(rtty_conf *ctx)
+{
+    FILE *echo;
+    unsigned char *out;
+    int *sum;
+    rtty_conf *c;
+    long left;
+    int all_done;
+    int frames;
+    int shift;
+    int spacing;
+    int n;
+    int i;
 
-        if (ctx->bufidx >= ctx->frames) {
-            sts = snd_pcm_writei(ctx->pcm, ctx->buf, ctx->frames/frame_size);
-            if (sts < 0)
-            {
-                printf("snd_pcm_writei 1: error %d\n", sts);
-                snd_pcm_prepare(ctx->pcm);
+    /*
+     * Now that the rate is settled, every mark must be below Nyquist,
+     * and the channels apart by the shift and both keying sidebands.
+     */
+    shift = ctx->freq_high - ctx->freq_low;
+    spacing = shift + 2 * ctx->baud / 100;
+    for (i = 0; i < vft_count; i++) {
+        if (vft[i].freq + shift >= ctx->speed / 2) {
+            fprintf(stderr, "--vft-channel %d: mark %d Hz is not below half "
+                    "the %d Hz rate\n", vft[i].freq, vft[i].freq + shift,
+                    ctx->speed);
+            exit(1);
+        }
+        for (n = 0; n < i; n++) {
+            if (abs(vft[i].freq - vft[n].freq) < spacing) {
+                fprintf(stderr, "--vft-channel %d and %d: channels must be "
+                        "at least %d Hz apart\n", vft[n].freq, vft[i].freq,
+                        spacing);
+                exit(1);
             }
-            ctx->bufidx = 0;
         }
-        e1 -= g1;
     }
+
+    echo = fopen("/dev/null", "w");
+    sum = (int *) malloc(ctx->frames * sizeof(int));
+    out = (unsigned char *) malloc(ctx->frames * ctx->frame_size);
+    if (echo == NULL || sum == NULL || out == NULL) {
+        perror("vft");
+        exit(1);
+    }
+    for (i = 0; i < vft_count; i++)
+        vft_open(ctx, &vft[i], echo);
+
+    for (;;) {
+        /* Once every channel has finished, only its unmixed traffic */
+        frames = ctx->frames;
+        all_done = 1;
+        left = 0;
+        for (i = 0; i < vft_count; i++) {
+            if (!vft[i].done)
+                all_done = 0;
+            else if (vft[i].left > left)
+                left = vft[i].left;
+        }
+        if (all_done && left == 0)
+            break;
+        if (all_done && left < frames)
+            frames = left;
+
+        for (i = 0; i < vft_count; i++) {
+            c = &vft[i].ctx;
+            vft_fill(&vft[i], frames);
+            if (i == 0)
+                memcpy(sum, c->mem, frames * sizeof(int));
+            else
+                vft_mix(sum, (int *) c->mem, frames);
+
+            n = frames * c->frame_size;
+            memmove(c->mem, c->mem + n, c->out_bytes - n);
+            c->out_bytes -= n;
+            if (vft[i].done)
+                vft[i].left = vft[i].left > frames ? vft[i].left - frames : 0;
+        }
+        pcm_write(ctx, out, ctx->store(sum, frames, out));
+    }
+
+    for (i = 0; i < vft_count; i++) {
+        c = &vft[i].ctx;
+        if (c->symcache)
+            symcache_flush(c);
+        free(c->buf);
+        free(c->mem);
+        free(vft[i].text);
+        fcntl(vft[i].fd, F_SETFL, vft[i].flags);
+        if (vft[i].fd)
+            close(vft[i].fd);
+    }
+    free(sum);
+    free(out);
+    fclose(echo);
 }
 
+
+/*
+ * One quarter of a cosine, 1 << table_bits steps from 0 to pi/2, and
+ * two more past it so the interpolation at the end of a mirrored
+ * quadrant stays in the table. At the default 1024 steps that is
+ * 4 kB, which stays in L1 beside the output buffer.
+ */
 void
 gen_costab(rtty_conf *ctx)
 {
+    int size = (1 << ctx->table_bits) + 2;
     int i = 0;
     double d = 0.0;
 
-    ctx->costab = (signed short *) malloc(ctx->tabsize * sizeof(signed short));
+    ctx->costab = (int *) malloc(size * sizeof(int));
     if (ctx->costab == NULL) 
     {
         perror("malloc costab");
         exit(1);
     }
 
-    for (i = 0; i < ctx->tabsize; i++) 
+    for (i = 0; i < size; i++) 
     {
-        d = 2*M_PI*i;
-        ctx->costab[i] = (int)((ctx->volume/100.0)*COS_OFFSET*cos(d/ctx->tabsize));
+        d = M_PI/2*i;
+        ctx->costab[i] = (int)(tone_amplitude(ctx)*
+                               cos(d/(1 << ctx->table_bits)));
+    }
+}
+
+
+/*
+ * --nco-report: how closely the NCO follows a true cosine with this
+ * table. The error is measured against cos() over many phases; no
+ * spur can be larger than its peak. The frequency has no error, since
+ * the phase step's remainder is carried exactly.
+ */
+void nco_report(rtty_conf *ctx)
+{
+    double amp = tone_amplitude(ctx);
+    double err, peak = 0.0, sum = 0.0;
+    unsigned int p = 0;
+    unsigned int d1;
+    int i;
+
+    fprintf(stderr, "nco: 32-bit phase, quarter-wave table of %d entries "
+            "(%d bytes), %d interpolation bits\n", 1 << ctx->table_bits,
+            (int) (((1 << ctx->table_bits) + 2) * sizeof(int)),
+            ctx->table_bits - 1);
+    for (i = 0; i < 2; i++) {
+        int f1 = i ? ctx->freq_high : ctx->freq_low;
+
+        d1 = ((unsigned long long) f1 << 32) / ctx->speed;
+        fprintf(stderr, "nco: %d Hz at %d Hz is a step of %u + %u/%d, "
+                "exact\n", f1, ctx->speed, d1,
+                (unsigned int) (((unsigned long long) f1 << 32) %
+                                ctx->speed), ctx->speed);
+    }
+    if (amp <= 0.0)
+        return;
+
+    /* A step of the golden ratio reaches every part of the table */
+    for (i = 0; i < NCO_REPORT_PHASES; i++) {
+        err = nco_sample(ctx->costab, ctx->table_bits, p) -
+              amp * cos(2 * M_PI * (p / 4294967296.0));
+        if (fabs(err) > peak)
+            peak = fabs(err);
+        sum += err * err;
+        p += 0x9e3779b9u;
     }
+    fprintf(stderr, "nco: error peak %.1f dBc, so no spur is higher; "
+            "rms %.1f dBc\n", 20 * log10(peak / amp + 1e-300),
+            20 * log10(sqrt(sum / NCO_REPORT_PHASES) / amp + 1e-300));
 }
 
 